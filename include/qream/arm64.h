@@ -1,7 +1,25 @@
 #pragma once
 
+#include <span>
 #include <vector>
 
+#include <absl/status/status.h>
+
+#include "qream/env.h"
 #include "qream/ir.h"
+#include "qream/memory.h"
+
+// Appends the code for `ops` to `out`. On error, `out` may hold part of
+// the block.
+absl::Status transpile_to_arm64(
+    std::span<const Operation> ops, OutputIt &out,
+    MemoryMode mem_mode = MemoryMode::Segmented);
+
+// Host entry/exit trampoline matching `EntryFn` in qream/runtime.h.
+std::vector<uint8_t> emit_arm64_trampoline();
+
+constexpr const size_t kArm64JumpSize = 4;
 
-std::vector<uint8_t> transpile_to_arm64(const std::vector<Operation> &ops);
+// Rewrites the link site at `site` into a B to `target`; false if it's
+// out of range.
+bool patch_arm64_jump(uint8_t *site, const uint8_t *target);
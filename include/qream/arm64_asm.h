@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+#include <absl/container/flat_hash_map.h>
+#include <absl/status/status.h>
+
+#include "qream/env.h"
+
+enum class Cond : uint32_t {
+  EQ = 0b0000,
+  NE = 0b0001,
+};
+
+struct Label {
+  uint32_t id;
+};
+
+// Collects ARM64 code with symbolic branch and literal targets and
+// resolves them in `finish`. Straight-line instructions are written
+// through `out()`; anything PC-relative goes through the methods below
+// and is recorded as a fixup.
+//
+// Fixups start in their short form and `finish` only promotes the ones
+// whose target ends up out of range:
+//   B        +-128 MiB -> ADRP x16; ADD x16; BR x16
+//   B.cond   +-1 MiB   -> B.!cond +8; B
+//   CBZ/CBNZ +-1 MiB   -> CBNZ/CBZ +8; B
+//   TBZ/TBNZ +-32 KiB  -> TBNZ/TBZ +8; B
+//   ADR      +-1 MiB   -> ADRP; ADD
+//   LDR lit  +-1 MiB   -> ADRP; LDR [lo12]
+// Promotion only grows the code, so the pass reaches a fixed point.
+class Arm64Assembler {
+ public:
+  Arm64Assembler() : out_(std::back_inserter(code_)) {}
+  Arm64Assembler(const Arm64Assembler &) = delete;
+  Arm64Assembler &operator=(const Arm64Assembler &) = delete;
+
+  OutputIt &out() { return out_; }
+
+  Label new_label();
+  void bind(Label label);
+
+  // 64-bit constant placed in the literal pool after the code; equal
+  // values share a slot.
+  Label literal(uint64_t value);
+
+  void b(Label target);
+  void b_cond(Cond cond, Label target);
+  void cbz(uint32_t rt, Label target);
+  void cbnz(uint32_t rt, Label target);
+  void tbz(uint32_t rt, uint32_t bit, Label target);
+  void tbnz(uint32_t rt, uint32_t bit, Label target);
+  void adr(uint32_t rd, Label target);
+  void ldr_literal(uint32_t rt, Label target);
+
+  // Relaxes and resolves every fixup and writes the code followed by the
+  // literal pool. ADRP-based long forms are only correct if the code is
+  // placed at `base` modulo 4 KiB.
+  absl::Status finish(uint64_t base, OutputIt &out);
+
+  // Drops everything emitted so far but keeps the allocations, so one
+  // assembler can be reused across blocks.
+  void reset();
+
+ private:
+  enum class FixupKind { B, BCond, Cbz, Cbnz, Tbz, Tbnz, Adr, LdrLiteral };
+
+  struct Fixup {
+    size_t pos;
+    FixupKind kind;
+    Label target;
+    uint32_t reg = 0;  // Rt/Rd
+    uint32_t aux = 0;  // condition or bit number
+    bool long_form = false;
+  };
+
+  struct LabelInfo {
+    std::optional<size_t> pos;
+    std::optional<size_t> literal;
+  };
+
+  static bool in_short_range(FixupKind kind, int64_t offset);
+  void add_fixup(FixupKind kind, Label target, uint32_t reg = 0,
+                 uint32_t aux = 0);
+
+  std::vector<uint8_t> code_;
+  OutputIt out_;
+  std::vector<Fixup> fixups_;
+  std::vector<LabelInfo> labels_;
+  std::vector<uint64_t> literals_;
+  absl::flat_hash_map<uint64_t, Label> literal_labels_;
+  // growth_[i] is how many bytes long forms add before fixups_[i]
+  std::vector<size_t> growth_;
+};
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <span>
+#include <vector>
+
+#include <absl/status/status.h>
+#include <absl/status/statusor.h>
+
+#include "qream/env.h"
+#include "qream/ir.h"
+#include "qream/memory.h"
+
+enum class Backend {
+  Arm64,
+  X86_64,
+};
+
+// Backend whose code runs natively on this host.
+Backend host_backend();
+
+// Appends the code for `ops` to `out`. On error, `out` may hold part of
+// the block.
+absl::Status transpile(Backend backend, std::span<const Operation> ops,
+                       OutputIt &out,
+                       MemoryMode mem_mode = MemoryMode::Segmented);
+
+absl::StatusOr<std::vector<uint8_t>> transpile(
+    Backend backend, std::span<const Operation> ops,
+    MemoryMode mem_mode = MemoryMode::Segmented);
+
+std::vector<uint8_t> emit_trampoline(Backend backend);
+
+// Points the direct-jump link site at `site` to `target`, or back at its
+// own exit stub when `target` is null. Returns false if out of range.
+bool patch_direct_jump(Backend backend, uint8_t *site,
+                       const uint8_t *target);
+
+// Bytes `patch_direct_jump` rewrites at a link site.
+size_t direct_jump_size(Backend backend);
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <span>
+#include <thread>
+#include <vector>
+
+#include <absl/status/status.h>
+
+#include "qream/backend.h"
+#include "qream/ir.h"
+#include "qream/memory.h"
+
+// Where a region's code ended up in the batch output.
+struct RegionResult {
+  absl::Status status;
+  size_t offset = 0;
+  size_t size = 0; // 0 if translation failed
+};
+
+// Translates many independent regions at once on a fixed set of worker
+// threads. Workers emit into per-thread scratch buffers that live as long
+// as the pool, then the code is laid out in region order in the output,
+// so a batch costs a handful of allocations regardless of region count.
+//
+// `translate` must not be called concurrently on the same pool.
+class TranslationPool {
+ public:
+  explicit TranslationPool(size_t threads = default_threads());
+  TranslationPool(const TranslationPool &) = delete;
+  TranslationPool &operator=(const TranslationPool &) = delete;
+  ~TranslationPool();
+
+  static size_t default_threads() {
+    return std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  // Appends the code for every region to `out`; results[i] locates
+  // regions[i] within it. A failed region leaves no code behind.
+  std::vector<RegionResult> translate(
+      Backend backend, std::span<const std::span<const Operation>> regions,
+      std::vector<uint8_t> &out,
+      MemoryMode mem_mode = MemoryMode::Segmented);
+
+  // Same, into a buffer owned by the pool and reused by the next call.
+  std::vector<RegionResult> translate(
+      Backend backend, std::span<const std::span<const Operation>> regions,
+      MemoryMode mem_mode = MemoryMode::Segmented) {
+    output_.clear();
+    return translate(backend, regions, output_, mem_mode);
+  }
+
+  // Output of the last pool-buffered `translate`.
+  std::span<const uint8_t> code() const { return output_; }
+
+ private:
+  // Where a worker put a region in its scratch buffer.
+  struct Placement {
+    size_t worker;
+    size_t offset;
+    size_t size;
+    absl::Status status;
+  };
+
+  struct Job {
+    Backend backend;
+    MemoryMode mem_mode;
+    std::span<const std::span<const Operation>> regions;
+    std::span<Placement> placements;
+  };
+
+  // A worker's buffer on a cache line of its own, so workers growing
+  // their vectors don't false-share the neighbouring headers.
+  struct alignas(64) Scratch {
+    std::vector<uint8_t> code;
+  };
+
+  void worker_loop(size_t id);
+  void run_job(size_t id);
+
+  std::vector<Scratch> scratch_; // one per worker
+  std::vector<uint8_t> output_;
+
+  Job job_{};
+  std::atomic<size_t> next_region_ = 0;
+
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::condition_variable done_;
+  uint64_t generation_ = 0;
+  size_t busy_ = 0;
+  bool stopping_ = false;
+
+  // last, so the workers are gone before the state above
+  std::vector<std::jthread> workers_;
+};
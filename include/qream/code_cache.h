@@ -0,0 +1,139 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <span>
+#include <utility>
+#include <vector>
+
+#include <absl/container/flat_hash_map.h>
+#include <absl/status/statusor.h>
+
+#include "qream/backend.h"
+
+struct CodeCacheOptions {
+  // hard ceiling on emitted code, nursery included
+  size_t budget = size_t{64} << 20;
+  size_t nursery_size = size_t{8} << 20;
+  // dispatcher lookups a nursery block needs to survive a flush; blocks
+  // other code is chained into always survive
+  uint32_t promote_after = 2;
+};
+
+struct HostRange {
+  const uint8_t *begin;
+  const uint8_t *end;
+
+  bool contains(uint64_t host) const {
+    return host >= reinterpret_cast<uint64_t>(begin) &&
+           host < reinterpret_cast<uint64_t>(end);
+  }
+};
+
+// Translated-code store with a fixed memory budget, split into two
+// generations:
+//   - new blocks go to the nursery, a bump region that is flushed
+//     wholesale when it fills up;
+//   - blocks still in use at that point are copied into the long-lived
+//     region, a ring that evicts its oldest blocks to make room.
+// Direct jumps chained into a block are tracked so eviction and
+// promotion can repoint or unlink them. Blocks are moved by copying, so
+// their code must be position independent; the backends only emit
+// page-relative code (ARM64 ADRP) in blocks large enough to be kept
+// page-aligned.
+//
+// The memory is R+X except for the pages `insert` and `link` write to,
+// which are RW (and so not executable) until they return. The cache must
+// not be mutated while other threads execute from it.
+class CodeCache {
+ public:
+  static absl::StatusOr<CodeCache> create(Backend backend,
+                                          CodeCacheOptions options = {});
+
+  CodeCache(const CodeCache &) = delete;
+  CodeCache &operator=(const CodeCache &) = delete;
+  CodeCache(CodeCache &&other);
+  CodeCache &operator=(CodeCache &&other);
+  ~CodeCache();
+
+  // Copies `code` into the nursery, replacing any block for `guest_addr`.
+  absl::StatusOr<const uint8_t *> insert(uint64_t guest_addr,
+                                         std::span<const uint8_t> code);
+
+  // Host code for `guest_addr`, or null. Counts towards promotion.
+  const uint8_t *lookup(uint64_t guest_addr);
+
+  // Repoints the direct-jump link site `site` inside a cached block at the
+  // code for `target`. No-op if either is gone or out of range.
+  void link(uint8_t *site, uint64_t target);
+
+  // Host ranges whose code was dropped or moved since the last call;
+  // anything caching host pointers into them must forget them.
+  std::vector<HostRange> take_evicted() {
+    return std::exchange(evicted_, {});
+  }
+
+  size_t size() const { return blocks_.size(); }
+
+ private:
+  // A patched link site: `site` bytes into the block for `guest`.
+  struct Link {
+    uint64_t guest;
+    size_t site;
+
+    bool operator==(const Link &) const = default;
+  };
+
+  struct Block {
+    uint8_t *host;
+    size_t size;
+    uint32_t hits = 0;
+    std::vector<Link> incoming; // sites in other blocks jumping here
+    std::vector<Link> outgoing; // (target, site in this block)
+  };
+
+  CodeCache(Backend backend, CodeCacheOptions options, uint8_t *mem)
+      : backend_(backend),
+        options_(options),
+        mem_(mem),
+        nursery_head_(mem),
+        old_head_(mem + options.nursery_size) {}
+
+  uint8_t *nursery_end() const { return mem_ + options_.nursery_size; }
+  uint8_t *old_end() const { return mem_ + options_.budget; }
+
+  void flush_nursery();
+  bool promote(uint64_t guest_addr);
+  uint8_t *alloc_old(size_t size);
+  void repatch(Block &block, uint64_t guest_addr);
+  void evict(uint64_t guest_addr);
+
+  // Makes the pages under [begin, begin + size) writable until the
+  // enclosing WriteScope ends.
+  bool unseal(uint8_t *begin, size_t size);
+  bool seal();
+  // patch_direct_jump, unsealing the site first
+  bool patch(uint8_t *site, const uint8_t *target);
+
+  class WriteScope;
+
+  Backend backend_;
+  CodeCacheOptions options_;
+  uint8_t *mem_ = nullptr;
+  uint8_t *nursery_head_ = nullptr;
+  uint8_t *old_head_ = nullptr;
+
+  absl::flat_hash_map<uint64_t, Block> blocks_;
+  std::map<const uint8_t *, uint64_t> by_host_;
+  std::vector<uint64_t> nursery_;
+  // long-lived blocks, oldest first
+  std::deque<uint64_t> old_;
+  std::vector<HostRange> evicted_;
+
+  // page ranges unsealed by the current mutation, or all of the memory
+  // once there are too many to track
+  std::vector<std::pair<uint8_t *, uint8_t *>> unsealed_;
+  bool unsealed_all_ = false;
+};
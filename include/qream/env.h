@@ -0,0 +1,20 @@
+#pragma once
+
+#include <cstdint>
+#include <iterator>
+#include <vector>
+
+#include "qream/memory.h"
+
+// Translation state shared by the backends.
+
+using OutputIt = std::back_insert_iterator<std::vector<uint8_t>>;
+
+struct Env {
+  uint64_t pc;
+  // how the generated code reaches guest memory
+  MemoryMode mem_mode;
+
+  Env(uint64_t entrypoint, MemoryMode mem_mode = MemoryMode::Segmented)
+      : pc(entrypoint), mem_mode(mem_mode) {}
+};
@@ -1,8 +1,12 @@
 #pragma once
 
+#include <algorithm>
+
 #include <absl/status/status.h>
+#include <absl/strings/str_format.h>
 
 #include "qream/ir.h"
+#include "qream/utils.h"
 
 using enum IROp;
 using enum ScalarDType;
@@ -37,20 +41,62 @@ struct extract_operands {
   }
 };
 
+// Returned by match_op for an op of another signature. Backends try one
+// signature after the next, so this is routine and carries no message,
+// which would cost an allocation; `explain_mismatch` adds one once none
+// matched.
+inline absl::Status signature_mismatch() {
+  return absl::Status(absl::StatusCode::kInvalidArgument, "");
+}
+
+inline absl::Status explain_mismatch(absl::Status status,
+                                     const Operation &op) {
+  if (status.code() != absl::StatusCode::kInvalidArgument ||
+      !status.message().empty()) {
+    return status;
+  }
+  return absl::InvalidArgumentError(
+      absl::StrFormat("%s: Op signature doesn't match", op.toString()));
+}
+
 template <ScalarDType dtype, VectorShape shape, typename... OperandTypes,
           typename Handler, typename OutputIt>
 absl::Status match_op(const Operation &op, Handler &&handler,
                       OutputIt &out) {
   if (op.dtype != dtype || op.shape != shape) {
-    return absl::InvalidArgumentError("Op signature doesn't match");
+    return signature_mismatch();
   }
 
   if (!extract_operands<OperandTypes...>::try_match(
           op, std::forward<Handler>(handler), out)) {
-    return absl::InvalidArgumentError("Op signature doesn't match");
+    return signature_mismatch();
   }
 
   return absl::OkStatus();
 }
 
 #define MATCH_OP(DTYPE, SHAPE, ...) match_op<DTYPE, SHAPE, __VA_ARGS__>
+
+// InvalidArgument unless `usable(enc)` holds for every register `op`
+// names, address components included. Backends call this before
+// emitting so guest operands can't alias their reserved registers.
+template <typename Pred>
+absl::Status check_registers(const Operation &op, Pred &&usable) {
+  auto check = [&](const Register &reg) {
+    if (usable(reg.enc)) return absl::OkStatus();
+    return absl::InvalidArgumentError(absl::StrFormat(
+        "%s: register %d is not a guest register", op.toString(), reg.enc));
+  };
+
+  size_t count = std::min(op.num_operands, op.operands.size());
+  for (size_t i = 0; i < count; ++i) {
+    if (const auto *reg = std::get_if<Register>(&op.operands[i])) {
+      TRY(check(*reg));
+    } else if (const auto *mem =
+                   std::get_if<MemoryAddressing>(&op.operands[i])) {
+      if (mem->base_reg) TRY(check(*mem->base_reg));
+      if (mem->index) TRY(check(*mem->index));
+    }
+  }
+  return absl::OkStatus();
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include <absl/status/statusor.h>
+
+using MMU = uint64_t (*)(uint64_t);
+
+enum class MemoryMode {
+  // each segment is mapped wherever the host puts it and accesses are
+  // translated per segment
+  Segmented,
+  // segments live at `window_base + guest_base` inside one reserved
+  // window, so translation is a single add off a pinned base register
+  Flat,
+};
+
+// A flat window covers a 32-bit guest address space; the guard behind it
+// catches accesses that straddle the 4 GiB boundary.
+constexpr const size_t kFlatWindowSize = size_t{1} << 32;
+constexpr const size_t kFlatGuardSize = size_t{64} << 10;
+
+struct SegmentFlags {
+  bool cachable : 1;
+  bool read_only : 1;
+  bool executable : 1;
+  bool device_mapped : 1;
+};
+
+struct AllocatedSegment {
+  uint64_t guest_base;
+  void *mem;
+  size_t length;
+  SegmentFlags flags;
+
+  bool contains(uint64_t guest_addr) const {
+    return guest_addr >= guest_base && guest_addr < guest_base + length;
+  }
+
+  bool is_cachable() const { return flags.cachable; }
+
+  uint64_t to_host(uint64_t guest_addr) const {
+    return reinterpret_cast<uint64_t>(mem) + (guest_addr - guest_base);
+  }
+};
+
+struct GuestMemory {
+  MMU resolve = nullptr;
+  MemoryMode mode = MemoryMode::Segmented;
+  // start of the reserved window in `Flat` mode
+  uint8_t *window_base = nullptr;
+  std::vector<AllocatedSegment> segments;
+
+  GuestMemory() = default;
+  GuestMemory(const GuestMemory &) = delete;
+  GuestMemory &operator=(const GuestMemory &) = delete;
+  GuestMemory(GuestMemory &&other)
+      : resolve(other.resolve),
+        mode(other.mode),
+        window_base(std::exchange(other.window_base, nullptr)),
+        segments(std::move(other.segments)) {}
+  GuestMemory &operator=(GuestMemory &&other);
+  ~GuestMemory();
+
+  // Reserves the whole window (plus guard) as inaccessible address space;
+  // `mapInto` later commits pieces of it.
+  static absl::StatusOr<GuestMemory> flat();
+
+  const AllocatedSegment *get_segment(uint64_t guest_addr) const {
+    for (const auto &seg : segments) {
+      if (seg.contains(guest_addr)) {
+        return &seg;
+      }
+    }
+    return nullptr;
+  }
+
+  // Maps `length` bytes, rounded up to whole pages, at `guest_base`.
+  // Fails for a range overlapping another segment and, in `Flat` mode,
+  // for one that is unaligned or not inside the window.
+  absl::StatusOr<AllocatedSegment> mapInto(uint64_t guest_base,
+                                           size_t length,
+                                           SegmentFlags flags);
+
+  std::optional<uint64_t> resolve_static(uint64_t guest_addr) const {
+    if (mode == MemoryMode::Flat) {
+      return reinterpret_cast<uint64_t>(window_base) + guest_addr;
+    }
+
+    const AllocatedSegment *seg = get_segment(guest_addr);
+    if (seg && seg->is_cachable()) {
+      return seg->to_host(guest_addr);
+    }
+    return std::nullopt;
+  }
+};
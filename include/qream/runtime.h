@@ -0,0 +1,143 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+#include <absl/status/status.h>
+#include <absl/status/statusor.h>
+
+#include "qream/code_cache.h"
+
+// Tag of an empty return stack slot. A guest can still branch to it, so
+// probes also treat a null `host` as a miss.
+constexpr const uint64_t kInvalidGuestAddr = ~uint64_t{0};
+
+constexpr const size_t kIbtcBits = 10;
+constexpr const size_t kIbtcEntries = size_t{1} << kIbtcBits;
+
+constexpr const size_t kRasBits = 4;
+constexpr const size_t kRasDepth = size_t{1} << kRasBits;
+
+// Why generated code handed control back to the dispatcher.
+enum class ExitReason : uint64_t {
+  LookupMiss, // indirect target not in the branch cache, see `pc`
+  Halt,       // guest executed `Halt` at `pc`
+};
+
+struct BranchTarget {
+  uint64_t guest = kInvalidGuestAddr;
+  uint64_t host = 0;
+};
+
+// Direct-mapped guest -> host code cache probed inline by indirect
+// jumps. The emitted lookup hashes exactly like `index`.
+struct IndirectBranchCache {
+  std::array<BranchTarget, kIbtcEntries> entries = empty();
+
+  static size_t index(uint64_t guest) {
+    return guest & (kIbtcEntries - 1);
+  }
+
+  // Empty slots are tagged with an address that hashes to a different
+  // slot, so the probe can't match them whatever the guest jumps to.
+  static std::array<BranchTarget, kIbtcEntries> empty() {
+    std::array<BranchTarget, kIbtcEntries> entries;
+    for (size_t i = 0; i < kIbtcEntries; ++i) {
+      entries[i] = BranchTarget{.guest = i ^ 1, .host = 0};
+    }
+    return entries;
+  }
+
+  void insert(uint64_t guest, uint64_t host) {
+    entries[index(guest)] = BranchTarget{guest, host};
+  }
+
+  uint64_t lookup(uint64_t guest) const {
+    const BranchTarget &entry = entries[index(guest)];
+    return entry.guest == guest ? entry.host : 0;
+  }
+
+  void flush() { entries = empty(); }
+};
+
+// Shadow stack of (guest return address, host continuation) pairs pushed
+// by `Call` and popped by `Ret`. It's only a predictor: overflow wraps
+// around and a mismatch falls back to the branch cache.
+struct ReturnStack {
+  uint64_t top = 0;
+  std::array<BranchTarget, kRasDepth> entries{};
+
+  void flush() {
+    top = 0;
+    entries.fill(BranchTarget{});
+  }
+};
+
+// Per-vCPU state addressed by generated code through a pinned host
+// register; field offsets are baked into the emitted code. The register
+// file comes first so the trampoline can reach it with LDP/STP.
+struct VCpuState {
+  std::array<uint64_t, 32> regs{};
+  uint64_t pc = 0;
+  ExitReason exit_reason = ExitReason::LookupMiss;
+  // Guest-to-host translation table handed to memory helpers.
+  const void *tlb = nullptr;
+  // Flat window base, pinned in x27 for the whole run slice.
+  uint8_t *mem_base = nullptr;
+  // Direct-jump site that exited with `LookupMiss`, for chaining; 0 when
+  // the exit came from an indirect branch.
+  uint64_t link_site = 0;
+  ReturnStack ras;
+  IndirectBranchCache ibtc;
+  // Dispatcher epoch `ras` and `ibtc` were filled in; see Dispatcher.
+  uint64_t cache_epoch = 0;
+};
+
+static_assert(offsetof(VCpuState, ibtc) + sizeof(IndirectBranchCache) <
+                  32768,
+              "VCpuState fields must stay reachable by scaled LDR/STR");
+
+constexpr const uint32_t kRasTopOffset =
+    offsetof(VCpuState, ras) + offsetof(ReturnStack, top);
+constexpr const uint32_t kRasEntriesOffset =
+    offsetof(VCpuState, ras) + offsetof(ReturnStack, entries);
+constexpr const uint32_t kIbtcEntriesOffset =
+    offsetof(VCpuState, ibtc) + offsetof(IndirectBranchCache, entries);
+
+// Entry trampoline emitted by the backend: saves the host callee-saved
+// registers, pins `state`, loads the guest register file and jumps to
+// `code`. Returns once generated code exits, with the registers written
+// back.
+using EntryFn = ExitReason (*)(VCpuState *state, const void *code);
+
+absl::StatusOr<void *> map_executable(std::span<const uint8_t> code);
+void unmap_executable(void *mem, size_t length);
+
+// Host side of the run loop: enters generated code once per run slice
+// and only comes back here when it can't continue on its own.
+//
+// Branch caches in a VCpuState hold host pointers into the code cache.
+// Rather than track states, the dispatcher moves to a fresh epoch
+// whenever the cache drops or moves code, and `run` flushes the caches
+// of any state last filled in another epoch (or by another dispatcher).
+class Dispatcher {
+ public:
+  Dispatcher(EntryFn enter, CodeCache cache);
+
+  absl::Status add_block(uint64_t guest_addr,
+                         std::span<const uint8_t> code);
+
+  // Runs from `state.pc` until an exit the dispatcher can't resolve by
+  // itself, and returns that exit. Resolved exits from a direct jump are
+  // chained so the jump skips the dispatcher next time.
+  absl::StatusOr<ExitReason> run(VCpuState &state);
+
+  CodeCache &cache() { return cache_; }
+
+ private:
+  EntryFn enter_;
+  CodeCache cache_;
+  uint64_t epoch_;
+};
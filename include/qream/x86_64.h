@@ -0,0 +1,25 @@
+#pragma once
+
+#include <span>
+#include <vector>
+
+#include <absl/status/status.h>
+
+#include "qream/env.h"
+#include "qream/ir.h"
+#include "qream/memory.h"
+
+// Appends the code for `ops` to `out`. On error, `out` may hold part of
+// the block.
+absl::Status transpile_to_x86_64(
+    std::span<const Operation> ops, OutputIt &out,
+    MemoryMode mem_mode = MemoryMode::Segmented);
+
+// Host entry/exit trampoline matching `EntryFn` in qream/runtime.h.
+std::vector<uint8_t> emit_x86_64_trampoline();
+
+constexpr const size_t kX86_64JumpSize = 5;
+
+// Rewrites the JMP rel32 link site at `site` to land on `target`; false if
+// it's out of range.
+bool patch_x86_64_jump(uint8_t *site, const uint8_t *target);
@@ -1,17 +1,36 @@
+#include <cassert>
 #include <cstdint>
+#include <cstring>
+#include <optional>
 #include <vector>
 #include <absl/log/log.h>
 #include <absl/status/statusor.h>
-#include <sys/mman.h>
+#include <absl/strings/str_format.h>
 
+#include "qream/arm64.h"
+#include "qream/arm64_asm.h"
+#include "qream/env.h"
 #include "qream/ir.h"
 #include "qream/match.h"
+#include "qream/memory.h"
+#include "qream/runtime.h"
 #include "qream/utils.h"
 
-using OutputIt = std::back_insert_iterator<std::vector<uint8_t>>;
+// Host registers reserved by the translator; guest registers map 1:1 onto
+// the remaining ones, and ops naming anything else are rejected.
+constexpr const uint32_t kScratch0 = 16; // IP0
+constexpr const uint32_t kScratch1 = 17; // IP1
+constexpr const uint32_t kMemBaseReg = 27; // flat window base
+constexpr const uint32_t kStateReg = 28; // VCpuState *
 
-constexpr const size_t kInstructionSize = 4;
-constexpr const size_t kMemPoolSize = 1024;
+constexpr bool is_guest_reg(uint32_t enc) {
+  return enc < kMemBaseReg && enc != kScratch0 && enc != kScratch1;
+}
+
+constexpr const uint32_t kLdrX = 0b1111100101;
+constexpr const uint32_t kStrX = 0b1111100100;
+
+static_assert(sizeof(BranchTarget) == 16, "lookups index with lsl #4");
 
 namespace {
 
@@ -40,117 +59,142 @@ inline void emit_3reg(uint32_t opcode21, uint32_t rd, uint32_t rn,
   out++ = (instr >> 24) & 0xFF;
 }
 
-using MMU = uint64_t (*)(uint64_t);
-
-struct SegmentFlags {
-  bool cachable : 1;
-  bool read_only : 1;
-  bool executable : 1;
-  bool device_mapped : 1;
-};
-
-struct AllocatedSegment {
-  uint64_t guest_base;
-  void *mem;
-  size_t length;
-  SegmentFlags flags;
+inline void emit_instr(uint32_t instr, OutputIt &out) {
+  out++ = instr & 0xFF;
+  out++ = (instr >> 8) & 0xFF;
+  out++ = (instr >> 16) & 0xFF;
+  out++ = (instr >> 24) & 0xFF;
+}
 
-  bool contains(uint64_t guest_addr) const {
-    return guest_addr >= guest_base && guest_addr < guest_base + length;
-  }
+inline void emit_add_imm(uint32_t rd, uint32_t rn, uint32_t imm12,
+                         OutputIt &out) {
+  emit_instr(0x91000000 | (imm12 << 10) | (rn << 5) | rd, out);
+}
 
-  bool is_cachable() const { return flags.cachable; }
+inline void emit_sub_imm(uint32_t rd, uint32_t rn, uint32_t imm12,
+                         OutputIt &out) {
+  emit_instr(0xD1000000 | (imm12 << 10) | (rn << 5) | rd, out);
+}
 
-  uint64_t to_host(uint64_t guest_addr) const {
-    return reinterpret_cast<uint64_t>(mem) + (guest_addr - guest_base);
-  }
-};
+// ADD Xd, Xn, Xm, LSL #shift
+inline void emit_add_lsl(uint32_t rd, uint32_t rn, uint32_t rm,
+                         uint32_t shift, OutputIt &out) {
+  emit_instr(0x8B000000 | (rm << 16) | (shift << 10) | (rn << 5) | rd,
+             out);
+}
 
-struct ValuePool {
-  AllocatedSegment underlying_;
-  uint64_t current_offset = 0;
+inline void emit_add_imm_w(uint32_t rd, uint32_t rn, uint32_t imm12,
+                           OutputIt &out) {
+  emit_instr(0x11000000 | (imm12 << 10) | (rn << 5) | rd, out);
+}
 
-  ValuePool(AllocatedSegment underlying) : underlying_(underlying) {}
+inline void emit_add_w(uint32_t rd, uint32_t rn, uint32_t rm,
+                       OutputIt &out) {
+  emit_instr(0x0B000000 | (rm << 16) | (rn << 5) | rd, out);
+}
 
-  uint64_t addValue(std::span<const uint8_t> value) {
-    std::memcpy(static_cast<uint8_t *>(underlying_.mem) + current_offset,
-                value.data(), value.size());
-    uint64_t off = current_offset;
-    current_offset += value.size();
-    return off;
-  }
+// LDR/STR Xt, [Xn, Wm, UXTW]
+constexpr const uint32_t kLdrXUxtw = 0xF8604800;
+constexpr const uint32_t kStrXUxtw = 0xF8204800;
 
-  uint64_t addValue(uint64_t value) {
-    current_offset = (current_offset + 8) & 0xFFFFFFFFFFFFFFF8;
-    std::memcpy(static_cast<uint8_t *>(underlying_.mem) + current_offset,
-                &value, sizeof(value));
-    uint64_t off = current_offset;
-    current_offset += sizeof(value);
-    return off;
-  }
+inline void emit_ldst_uxtw(uint32_t opc, uint32_t rt, uint32_t rn,
+                           uint32_t rm, OutputIt &out) {
+  emit_instr(opc | (rm << 16) | (rn << 5) | rt, out);
+}
 
-  uint64_t guestBase() { return underlying_.guest_base; }
-};
+// UBFX Xd, Xn, #lsb, #width (alias of UBFM)
+inline void emit_ubfx(uint32_t rd, uint32_t rn, uint32_t lsb,
+                      uint32_t width, OutputIt &out) {
+  emit_instr(0xD3400000 | (lsb << 16) | ((lsb + width - 1) << 10) |
+                 (rn << 5) | rd,
+             out);
+}
 
-struct GuestMemory {
-  MMU resolve;
-  std::vector<AllocatedSegment> segments;
+inline void emit_cmp(uint32_t rn, uint32_t rm, OutputIt &out) {
+  emit_3reg(0b11101011000, 31, rn, rm, out);
+}
 
-  const AllocatedSegment *get_segment(uint64_t guest_addr) const {
-    for (const auto &seg : segments) {
-      if (seg.contains(guest_addr)) {
-        return &seg;
-      }
+// MOVZ/MOVK sequence, skipping zero halfwords.
+inline void emit_mov_imm64(uint32_t rd, uint64_t imm, OutputIt &out) {
+  emit_instr(0xD2800000 | ((imm & 0xFFFF) << 5) | rd, out);
+  for (uint32_t hw = 1; hw < 4; ++hw) {
+    uint64_t chunk = (imm >> (hw * 16)) & 0xFFFF;
+    if (chunk != 0) {
+      emit_instr(0xF2800000 | (hw << 21) | (chunk << 5) | rd, out);
     }
-    return nullptr;
   }
+}
 
-  AllocatedSegment mapInto(uint64_t guest_base, size_t length,
-                           SegmentFlags flags) {
-    size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
-    size_t aligned_length = (length + page_size - 1) & ~(page_size - 1);
+inline void emit_br(uint32_t rn, OutputIt &out) {
+  emit_instr(0xD61F0000 | (rn << 5), out);
+}
 
-    int prot = PROT_READ | PROT_WRITE;
-    if (flags.read_only) {
-      prot = PROT_READ;
-    }
-    if (flags.executable) {
-      prot |= PROT_EXEC;
-    }
+inline void emit_blr(uint32_t rn, OutputIt &out) {
+  emit_instr(0xD63F0000 | (rn << 5), out);
+}
 
-    void *mem = mmap(nullptr, aligned_length, prot,
-                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    assert(mem != MAP_FAILED);
+inline void emit_ret(OutputIt &out) { emit_instr(0xD65F03C0, out); }
 
-    AllocatedSegment seg{.guest_base = guest_base,
-                         .mem = mem,
-                         .length = aligned_length,
-                         .flags = flags};
-    segments.push_back(seg);
-    return seg;
-  }
+// MOV Xd, Xm (alias of ORR Xd, XZR, Xm)
+inline void emit_mov_reg(uint32_t rd, uint32_t rm, OutputIt &out) {
+  emit_instr(0xAA0003E0 | (rm << 16) | rd, out);
+}
 
-  std::optional<uint64_t> resolve_static(uint64_t guest_addr) const {
-    const AllocatedSegment *seg = get_segment(guest_addr);
-    if (seg && seg->is_cachable()) {
-      return seg->to_host(guest_addr);
-    }
-    return std::nullopt;
-  }
-};
+// STP/LDP Xt1, Xt2, [Xn, #offset]; opc selects the addressing form.
+constexpr const uint32_t kStpOffset = 0xA9000000;
+constexpr const uint32_t kLdpOffset = 0xA9400000;
+constexpr const uint32_t kStpPreIndex = 0xA9800000;
+constexpr const uint32_t kLdpPostIndex = 0xA8C00000;
+
+inline void emit_ldst_pair(uint32_t opc, uint32_t rt1, uint32_t rt2,
+                           uint32_t rn, int32_t offset, OutputIt &out) {
+  emit_instr(opc | (((offset / 8) & 0x7F) << 15) | (rt2 << 10) |
+                 (rn << 5) | rt1,
+             out);
+}
 
-struct Env {
-  uint64_t pc;
-  GuestMemory mem;
-  ValuePool const_pool;
+// Stores `reason` into the vCPU state and returns to the dispatcher.
+void emit_exit(ExitReason reason, OutputIt &out) {
+  emit_mov_imm64(kScratch1, static_cast<uint64_t>(reason), out);
+  emit_ldst_imm(kStrX, kScratch1, kStateReg,
+                offsetof(VCpuState, exit_reason) / 8, out);
+  emit_ret(out);
+}
 
-  Env(uint64_t entrypoint)
-      : pc(entrypoint), mem{}, const_pool(mem.mapInto(pc, kMemPoolSize)) {}
-};
+// Inline probe of the indirect branch cache for the guest address held in
+// `target`. Falls back to the dispatcher with `pc` set on a miss. Clobbers
+// x17 only, so `target` may be x16.
+void emit_ibtc_lookup(Arm64Assembler &as, uint32_t target) {
+  OutputIt &out = as.out();
+  Label miss = as.new_label();
+
+  emit_ubfx(kScratch1, target, 0, kIbtcBits, out);
+  emit_add_lsl(kScratch1, kStateReg, kScratch1, 4, out);
+  emit_ldst_imm(kLdrX, kScratch1, kScratch1,
+                (kIbtcEntriesOffset + offsetof(BranchTarget, guest)) / 8,
+                out);
+  emit_cmp(kScratch1, target, out);
+  as.b_cond(Cond::NE, miss);
+  // hit: recompute the slot rather than keep a third register live
+  emit_ubfx(kScratch1, target, 0, kIbtcBits, out);
+  emit_add_lsl(kScratch1, kStateReg, kScratch1, 4, out);
+  emit_ldst_imm(kLdrX, kScratch1, kScratch1,
+                (kIbtcEntriesOffset + offsetof(BranchTarget, host)) / 8,
+                out);
+  emit_br(kScratch1, out);
+
+  as.bind(miss);
+  emit_ldst_imm(kStrX, target, kStateReg, offsetof(VCpuState, pc) / 8,
+                out);
+  emit_exit(ExitReason::LookupMiss, out);
+}
 
 struct OpEmitter {
+  Arm64Assembler &as;
   OutputIt &out;
   Env &env;
+  // return address of a Call that ends the region so far
+  std::optional<uint64_t> fallthrough;
 
   absl::Status emit_binary_op(const Operation &op, uint32_t encoding) {
     return MATCH_OP(Int64, Scalar, Register, Register, Register)(
@@ -174,63 +218,230 @@ struct OpEmitter {
         out);
   }
 
+  // Flat mode: the 32-bit guest address is formed in a W register, so it
+  // wraps like the guest's would, and used as a zero-extended index off
+  // the window base. Anything past the window hits the guard.
+  static void emit_flat_access(uint32_t opc, const MemoryAddressing &mem,
+                               uint32_t rt, OutputIt &out) {
+    if (mem.base_reg && !mem.index && mem.offset == 0) {
+      emit_ldst_uxtw(opc, rt, kMemBaseReg, mem.base_reg->enc, out);
+      return;
+    }
+
+    uint32_t addr = kScratch0;
+    if (!mem.base_reg) {
+      emit_mov_imm64(kScratch0, static_cast<uint32_t>(mem.offset), out);
+      if (mem.index) {
+        emit_add_w(kScratch0, kScratch0, mem.index->enc, out);
+      }
+    } else {
+      uint32_t offset = static_cast<uint32_t>(mem.offset);
+      addr = mem.base_reg->enc;
+      if (mem.index) {
+        emit_add_w(kScratch0, addr, mem.index->enc, out);
+        addr = kScratch0;
+      }
+      if (offset >= 4096) {
+        emit_mov_imm64(kScratch1, offset, out);
+        emit_add_w(kScratch0, addr, kScratch1, out);
+        addr = kScratch0;
+      } else if (offset != 0) {
+        emit_add_imm_w(kScratch0, addr, offset, out);
+        addr = kScratch0;
+      }
+    }
+    emit_ldst_uxtw(opc, rt, kMemBaseReg, addr, out);
+  }
+
+  // Segmented mode: should call the MMU helper; until then guest
+  // registers hold host addresses. `opc` is kLdrX or kStrX.
+  static void emit_segmented_access(uint32_t opc,
+                                    const MemoryAddressing &mem,
+                                    uint32_t rt, OutputIt &out) {
+    if (mem.base_reg && !mem.index && mem.offset % 8 == 0 &&
+        mem.offset / 8 < 4096) {
+      emit_ldst_imm(opc, rt, mem.base_reg->enc, mem.offset / 8, out);
+      return;
+    }
+
+    emit_mov_imm64(kScratch0, mem.offset, out);
+    if (mem.base_reg) {
+      emit_add_lsl(kScratch0, kScratch0, mem.base_reg->enc, 0, out);
+    }
+    if (mem.index) {
+      emit_add_lsl(kScratch0, kScratch0, mem.index->enc, 0, out);
+    }
+    emit_ldst_imm(opc, rt, kScratch0, 0, out);
+  }
+
+  void emit_access(bool load, const MemoryAddressing &mem, uint32_t rt,
+                   OutputIt &out) {
+    if (env.mem_mode == MemoryMode::Flat) {
+      emit_flat_access(load ? kLdrXUxtw : kStrXUxtw, mem, rt, out);
+    } else {
+      emit_segmented_access(load ? kLdrX : kStrX, mem, rt, out);
+    }
+  }
+
   absl::Status emit_ldr(const Operation &op) {
+    RETURN_IF_OK(MATCH_OP(Int64, Scalar, MemoryAddressing, Register)(
+        op,
+        [this](const Operation &, const MemoryAddressing &mem,
+               const Register &rt, OutputIt &out) {
+          emit_access(/*load=*/true, mem, rt.enc, out);
+        },
+        out));
+
     // LDR with register: LDR Rt, =imm64 (literal pool load)
     return MATCH_OP(Int64, Scalar, Imm64, Register)(
         op,
-        [](const Operation &, const Imm64 &imm, const Register &rt,
-           OutputIt &out) {
-          uint32_t pool_offset = 0;
-          emit_ldst_imm(0b0101100, rt.enc, 31 /* PC */, pool_offset, out);
-        },
+        [this](const Operation &, const Imm64 &imm, const Register &rt,
+               OutputIt &) { as.ldr_literal(rt.enc, as.literal(imm)); },
         out);
   }
 
   absl::Status emit_str(const Operation &op) {
-    // should call MMU helper here
     RETURN_IF_OK(MATCH_OP(Int64, Scalar, MemoryAddressing, Register)(
         op,
         [this](const Operation &, const MemoryAddressing &mem,
                const Register &rt, OutputIt &out) {
-          uint32_t imm12 = mem.offset / 8;
-
-          emit_ldst_imm(0b1111100100, rt.enc, mem.base_reg->enc, imm12,
-                        out);
-          env.pc += 4;
+          emit_access(/*load=*/false, mem, rt.enc, out);
         },
         out));
 
     // STR with register: STR Rt, [Xn, #imm]
-    RETURN_IF_OK(MATCH_OP(Int64, Scalar, Imm64, Register)(
+    return MATCH_OP(Int64, Scalar, Imm64, Register)(
         op,
         [this](const Operation &, const Imm64 &imm, const Register &rt,
-               OutputIt &out) {
-          ValuePool &pool = env.const_pool;
+               OutputIt &) { as.ldr_literal(rt.enc, as.literal(imm)); },
+        out);
+  }
 
-          uint64_t imm_offset =
-              (pool.addValue(imm) + pool.guestBase() - env.pc) / 4;
+  absl::Status emit_jump(const Operation &op) {
+    RETURN_IF_OK(MATCH_OP(Int64, Scalar, Register)(
+        op,
+        [this](const Operation &, const Register &target, OutputIt &) {
+          emit_ibtc_lookup(as, target.enc);
+        },
+        out));
 
-          if (imm_offset < -1048576 || imm_offset > 1048575) {
-            return absl::OutOfRangeError("LDR literal offset out of range");
-          }
+    return MATCH_OP(Int64, Scalar, Imm64)(
+        op,
+        [this](const Operation &, const Imm64 &target, OutputIt &) {
+          emit_direct_jump(target);
+        },
+        out);
+  }
 
-          uint32_t instr =
-              0x58000000 | ((imm_offset & 0x1FFFFF) << 5) | rt.enc;
+  // Direct jumps exit through a link site: a B to the next instruction
+  // that the code cache repoints at the target once it's translated.
+  void emit_direct_jump(uint64_t target) {
+    Label site = as.new_label();
+    Label unlinked = as.new_label();
+
+    as.bind(site);
+    as.b(unlinked);
+
+    as.bind(unlinked);
+    emit_mov_imm64(kScratch0, target, out);
+    emit_ldst_imm(kStrX, kScratch0, kStateReg, offsetof(VCpuState, pc) / 8,
+                  out);
+    as.adr(kScratch1, site);
+    emit_ldst_imm(kStrX, kScratch1, kStateReg,
+                  offsetof(VCpuState, link_site) / 8, out);
+    emit_exit(ExitReason::LookupMiss, out);
+  }
 
-          out++ = instr & 0xFF;
-          out++ = (instr >> 8) & 0xFF;
-          out++ = (instr >> 16) & 0xFF;
-          out++ = (instr >> 24) & 0xFF;
+  // Pushes (return_addr, host address of `cont`) onto the shadow return
+  // stack; the caller emits the transfer and binds `cont` after it.
+  void emit_ras_push(uint64_t return_addr, Label cont) {
+    emit_ldst_imm(kLdrX, kScratch0, kStateReg, kRasTopOffset / 8, out);
+    emit_add_imm(kScratch0, kScratch0, 1, out);
+    emit_ubfx(kScratch0, kScratch0, 0, kRasBits, out);
+    emit_ldst_imm(kStrX, kScratch0, kStateReg, kRasTopOffset / 8, out);
+    emit_add_lsl(kScratch0, kStateReg, kScratch0, 4, out);
+    emit_mov_imm64(kScratch1, return_addr, out);
+    emit_ldst_imm(kStrX, kScratch1, kScratch0,
+                  (kRasEntriesOffset + offsetof(BranchTarget, guest)) / 8,
+                  out);
+    as.adr(kScratch1, cont);
+    emit_ldst_imm(kStrX, kScratch1, kScratch0,
+                  (kRasEntriesOffset + offsetof(BranchTarget, host)) / 8,
+                  out);
+  }
 
-          env.pc += 4;
-          return absl::OkStatus();
+  absl::Status emit_call(const Operation &op) {
+    // Call target, return_addr
+    RETURN_IF_OK(MATCH_OP(Int64, Scalar, Register, Imm64)(
+        op,
+        [this](const Operation &, const Register &target,
+               const Imm64 &return_addr, OutputIt &) {
+          Label cont = as.new_label();
+          emit_ras_push(return_addr, cont);
+          emit_ibtc_lookup(as, target.enc);
+          as.bind(cont);
+          fallthrough = return_addr;
         },
         out));
 
+    return MATCH_OP(Int64, Scalar, Imm64, Imm64)(
+        op,
+        [this](const Operation &, const Imm64 &target,
+               const Imm64 &return_addr, OutputIt &out) {
+          Label cont = as.new_label();
+          emit_ras_push(return_addr, cont);
+          emit_mov_imm64(kScratch0, target, out);
+          emit_ibtc_lookup(as, kScratch0);
+          as.bind(cont);
+          fallthrough = return_addr;
+        },
+        out);
+  }
+
+  absl::Status emit_ret(const Operation &op) {
+    // Pop the shadow stack and jump straight to the host continuation if
+    // it predicted this return; otherwise probe the branch cache.
+    return MATCH_OP(Int64, Scalar, Register)(
+        op,
+        [this](const Operation &, const Register &target, OutputIt &out) {
+          Label mispredict = as.new_label();
+
+          emit_ldst_imm(kLdrX, kScratch0, kStateReg, kRasTopOffset / 8,
+                        out);
+          emit_add_lsl(kScratch1, kStateReg, kScratch0, 4, out);
+          emit_sub_imm(kScratch0, kScratch0, 1, out);
+          emit_ubfx(kScratch0, kScratch0, 0, kRasBits, out);
+          emit_ldst_imm(kStrX, kScratch0, kStateReg, kRasTopOffset / 8,
+                        out);
+          emit_ldst_imm(
+              kLdrX, kScratch0, kScratch1,
+              (kRasEntriesOffset + offsetof(BranchTarget, guest)) / 8, out);
+          emit_cmp(kScratch0, target.enc, out);
+          as.b_cond(Cond::NE, mispredict);
+          emit_ldst_imm(
+              kLdrX, kScratch1, kScratch1,
+              (kRasEntriesOffset + offsetof(BranchTarget, host)) / 8, out);
+          // an empty slot has no host code
+          as.cbz(kScratch1, mispredict);
+          emit_br(kScratch1, out);
+
+          as.bind(mispredict);
+          emit_ibtc_lookup(as, target.enc);
+        },
+        out);
+  }
+
+  absl::Status emit_halt(const Operation &op) {
+    emit_mov_imm64(kScratch0, op.addr, out);
+    emit_ldst_imm(kStrX, kScratch0, kStateReg, offsetof(VCpuState, pc) / 8,
+                  out);
+    emit_exit(ExitReason::Halt, out);
     return absl::OkStatus();
   }
 
   absl::Status try_emit(const Operation &op) {
+    TRY(check_registers(op, is_guest_reg));
+    fallthrough.reset();
     switch (op.irop) {
       case IROp::Add:
         return emit_binary_op(op, 0b10001011000);
@@ -250,26 +461,109 @@ struct OpEmitter {
         return emit_ldr(op);
       case IROp::Str:
         return emit_str(op);
+      case IROp::Jump:
+        return emit_jump(op);
+      case IROp::Call:
+        return emit_call(op);
+      case IROp::Ret:
+        return emit_ret(op);
+      case IROp::Halt:
+        return emit_halt(op);
       default:
         return absl::InternalError(
             absl::StrFormat("%s not implemented", op.toString()));
     }
   }
+
+  // A predicted Ret lands right after its Call, so a region ending in one
+  // continues to the return address from there.
+  void finish() {
+    if (fallthrough) {
+      emit_direct_jump(*fallthrough);
+    }
+  }
 };
 
+// Guest registers are moved in pairs where possible: (x0, x1) ..
+// (x14, x15), (x18, x19) .. (x24, x25), then x26 on its own.
+void emit_guest_regs(bool load, OutputIt &out) {
+  for (uint32_t reg = 0; reg < kMemBaseReg; reg += 2) {
+    if (!is_guest_reg(reg)) continue;
+    uint32_t offset = offsetof(VCpuState, regs) + reg * 8;
+    if (is_guest_reg(reg + 1)) {
+      emit_ldst_pair(load ? kLdpOffset : kStpOffset, reg, reg + 1,
+                     kStateReg, offset, out);
+    } else {
+      emit_ldst_imm(load ? kLdrX : kStrX, reg, kStateReg, offset / 8, out);
+    }
+  }
+}
+
 } // namespace
 
-absl::StatusOr<std::vector<uint8_t>> transpile_to_arm64(
-    const std::vector<Operation> &ops) {
+std::vector<uint8_t> emit_arm64_trampoline() {
+  static_assert(offsetof(VCpuState, regs) + 8 * kMemBaseReg <= 504,
+                "register file must be reachable by LDP/STP");
+
   std::vector<uint8_t> code;
   OutputIt out = std::back_inserter(code);
 
-  Env env{0, GuestMemory{}};
-  OpEmitter emitter{out, env};
+  // ExitReason enter(VCpuState *state /* x0 */, const void *code /* x1 */)
+  emit_ldst_pair(kStpPreIndex, 29, 30, 31, -96, out);
+  emit_add_imm(29, 31, 0, out); // mov x29, sp
+  for (uint32_t reg = 19; reg < 29; reg += 2) {
+    emit_ldst_pair(kStpOffset, reg, reg + 1, 31, (reg - 17) * 8, out);
+  }
 
-  for (const Operation &op : ops) {
-    TRY(emitter.try_emit(op));
+  emit_mov_reg(kStateReg, 0, out);
+  emit_mov_reg(kScratch1, 1, out);
+  emit_ldst_imm(kLdrX, kMemBaseReg, kStateReg,
+                offsetof(VCpuState, mem_base) / 8, out);
+  emit_guest_regs(/*load=*/true, out);
+
+  // generated code leaves with RET, which lands right after this
+  emit_blr(kScratch1, out);
+
+  emit_guest_regs(/*load=*/false, out);
+  emit_ldst_imm(kLdrX, 0, kStateReg, offsetof(VCpuState, exit_reason) / 8,
+                out);
+
+  for (uint32_t reg = 19; reg < 29; reg += 2) {
+    emit_ldst_pair(kLdpOffset, reg, reg + 1, 31, (reg - 17) * 8, out);
   }
+  emit_ldst_pair(kLdpPostIndex, 29, 30, 31, 96, out);
+  emit_ret(out);
 
   return code;
 }
+
+bool patch_arm64_jump(uint8_t *site, const uint8_t *target) {
+  int64_t offset = target - site;
+  if (offset % 4 != 0 || offset < -(int64_t{1} << 27) ||
+      offset >= (int64_t{1} << 27)) {
+    return false;
+  }
+
+  uint32_t instr = 0x14000000 | ((offset >> 2) & 0x3FFFFFF);
+  std::memcpy(site, &instr, sizeof(instr));
+  __builtin___clear_cache(reinterpret_cast<char *>(site),
+                          reinterpret_cast<char *>(site + sizeof(instr)));
+  return true;
+}
+
+absl::Status transpile_to_arm64(std::span<const Operation> ops,
+                                OutputIt &out, MemoryMode mem_mode) {
+  // one per thread, so its buffers are reused from block to block
+  thread_local Arm64Assembler as;
+  as.reset();
+
+  Env env{0, mem_mode};
+  OpEmitter emitter{as, as.out(), env};
+
+  for (const Operation &op : ops) {
+    TRY(explain_mismatch(emitter.try_emit(op), op));
+  }
+  emitter.finish();
+
+  return as.finish(0, out);
+}
@@ -0,0 +1,296 @@
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include <absl/status/status.h>
+#include <absl/status/statusor.h>
+#include <absl/strings/str_format.h>
+
+#include "qream/arm64_asm.h"
+#include "qream/utils.h"
+
+namespace {
+
+constexpr const uint32_t kVeneerReg = 16; // IP0
+
+inline void put(uint32_t instr, OutputIt &out) {
+  out++ = instr & 0xFF;
+  out++ = (instr >> 8) & 0xFF;
+  out++ = (instr >> 16) & 0xFF;
+  out++ = (instr >> 24) & 0xFF;
+}
+
+// Signed, word-scaled immediate of `bits` bits.
+bool fits_scaled(int64_t offset, int bits) {
+  int64_t limit = int64_t{1} << (bits + 1);
+  return offset % 4 == 0 && offset >= -limit && offset < limit;
+}
+
+uint32_t scaled(int64_t offset, int bits) {
+  return static_cast<uint32_t>(offset >> 2) & ((uint32_t{1} << bits) - 1);
+}
+
+uint32_t encode_adr(uint32_t opc, uint32_t rd, int64_t imm) {
+  return opc | ((imm & 0x3) << 29) | (((imm >> 2) & 0x7FFFF) << 5) | rd;
+}
+
+absl::Status put_b(int64_t offset, OutputIt &out) {
+  if (!fits_scaled(offset, 26)) {
+    return absl::OutOfRangeError(
+        absl::StrFormat("branch offset %d out of range", offset));
+  }
+  put(0x14000000 | scaled(offset, 26), out);
+  return absl::OkStatus();
+}
+
+// ADRP rd to the page of `to`, returning the low 12 bits still to add.
+absl::StatusOr<uint32_t> put_adrp(uint32_t rd, uint64_t from, uint64_t to,
+                                  OutputIt &out) {
+  int64_t pages = static_cast<int64_t>(to >> 12) -
+                  static_cast<int64_t>(from >> 12);
+  if (pages < -(int64_t{1} << 20) || pages >= (int64_t{1} << 20)) {
+    return absl::OutOfRangeError("ADRP target out of range");
+  }
+  put(encode_adr(0x90000000, rd, pages), out);
+  return static_cast<uint32_t>(to & 0xFFF);
+}
+
+} // namespace
+
+bool Arm64Assembler::in_short_range(FixupKind kind, int64_t offset) {
+  switch (kind) {
+    case FixupKind::B:
+      return fits_scaled(offset, 26);
+    case FixupKind::Tbz:
+    case FixupKind::Tbnz:
+      return fits_scaled(offset, 14);
+    case FixupKind::Adr:
+      return offset >= -(1 << 20) && offset < (1 << 20);
+    default:
+      return fits_scaled(offset, 19);
+  }
+}
+
+Label Arm64Assembler::new_label() {
+  labels_.push_back(LabelInfo{});
+  return Label{static_cast<uint32_t>(labels_.size() - 1)};
+}
+
+void Arm64Assembler::bind(Label label) {
+  labels_[label.id].pos = code_.size();
+}
+
+Label Arm64Assembler::literal(uint64_t value) {
+  auto it = literal_labels_.find(value);
+  if (it != literal_labels_.end()) {
+    return it->second;
+  }
+
+  Label label = new_label();
+  labels_[label.id].literal = literals_.size();
+  literals_.push_back(value);
+  literal_labels_[value] = label;
+  return label;
+}
+
+void Arm64Assembler::add_fixup(FixupKind kind, Label target, uint32_t reg,
+                               uint32_t aux) {
+  fixups_.push_back(Fixup{.pos = code_.size(),
+                          .kind = kind,
+                          .target = target,
+                          .reg = reg,
+                          .aux = aux});
+  // placeholder, rewritten by `finish`
+  put(0, out_);
+}
+
+void Arm64Assembler::b(Label target) { add_fixup(FixupKind::B, target); }
+
+void Arm64Assembler::b_cond(Cond cond, Label target) {
+  add_fixup(FixupKind::BCond, target, 0, static_cast<uint32_t>(cond));
+}
+
+void Arm64Assembler::cbz(uint32_t rt, Label target) {
+  add_fixup(FixupKind::Cbz, target, rt);
+}
+
+void Arm64Assembler::cbnz(uint32_t rt, Label target) {
+  add_fixup(FixupKind::Cbnz, target, rt);
+}
+
+void Arm64Assembler::tbz(uint32_t rt, uint32_t bit, Label target) {
+  add_fixup(FixupKind::Tbz, target, rt, bit);
+}
+
+void Arm64Assembler::tbnz(uint32_t rt, uint32_t bit, Label target) {
+  add_fixup(FixupKind::Tbnz, target, rt, bit);
+}
+
+void Arm64Assembler::adr(uint32_t rd, Label target) {
+  add_fixup(FixupKind::Adr, target, rd);
+}
+
+void Arm64Assembler::ldr_literal(uint32_t rt, Label target) {
+  add_fixup(FixupKind::LdrLiteral, target, rt);
+}
+
+void Arm64Assembler::reset() {
+  code_.clear();
+  fixups_.clear();
+  labels_.clear();
+  literals_.clear();
+  literal_labels_.clear();
+  growth_.clear();
+}
+
+absl::Status Arm64Assembler::finish(uint64_t base, OutputIt &out) {
+  for (const LabelInfo &info : labels_) {
+    if (!info.pos && !info.literal) {
+      return absl::FailedPreconditionError("unbound label");
+    }
+  }
+
+  growth_.assign(fixups_.size() + 1, 0);
+  auto final_pos = [&](size_t pos) {
+    auto it = std::lower_bound(
+        fixups_.begin(), fixups_.end(), pos,
+        [](const Fixup &f, size_t p) { return f.pos < p; });
+    return pos + growth_[it - fixups_.begin()];
+  };
+  auto pool_start = [&] {
+    return (code_.size() + growth_.back() + 7) & ~size_t{7};
+  };
+  auto target_pos = [&](Label label) {
+    const LabelInfo &info = labels_[label.id];
+    if (info.literal) {
+      return pool_start() + *info.literal * sizeof(uint64_t);
+    }
+    return final_pos(*info.pos);
+  };
+
+  bool changed = true;
+  while (changed) {
+    for (size_t i = 0; i < fixups_.size(); ++i) {
+      size_t extra = 0;
+      if (fixups_[i].long_form) {
+        extra = fixups_[i].kind == FixupKind::B ? 8 : 4;
+      }
+      growth_[i + 1] = growth_[i] + extra;
+    }
+
+    changed = false;
+    for (Fixup &fixup : fixups_) {
+      if (fixup.long_form) continue;
+
+      int64_t offset = static_cast<int64_t>(target_pos(fixup.target)) -
+                       static_cast<int64_t>(final_pos(fixup.pos));
+      if (!in_short_range(fixup.kind, offset)) {
+        fixup.long_form = true;
+        changed = true;
+      }
+    }
+  }
+
+  size_t next = 0;
+  for (const Fixup &fixup : fixups_) {
+    std::copy(code_.begin() + next, code_.begin() + fixup.pos, out);
+    next = fixup.pos + 4;
+
+    uint64_t from = final_pos(fixup.pos);
+    uint64_t to = target_pos(fixup.target);
+    int64_t offset = static_cast<int64_t>(to) - static_cast<int64_t>(from);
+
+    switch (fixup.kind) {
+      case FixupKind::B: {
+        if (!fixup.long_form) {
+          TRY(put_b(offset, out));
+          break;
+        }
+        absl::StatusOr<uint32_t> lo12 =
+            put_adrp(kVeneerReg, base + from, base + to, out);
+        if (!lo12.ok()) return lo12.status();
+        put(0x91000000 | (*lo12 << 10) | (kVeneerReg << 5) | kVeneerReg,
+            out);
+        put(0xD61F0000 | (kVeneerReg << 5), out);
+        break;
+      }
+      case FixupKind::BCond:
+        if (!fixup.long_form) {
+          put(0x54000000 | (scaled(offset, 19) << 5) | fixup.aux, out);
+          break;
+        }
+        put(0x54000000 | (scaled(8, 19) << 5) | (fixup.aux ^ 1), out);
+        TRY(put_b(offset - 4, out));
+        break;
+      case FixupKind::Cbz:
+      case FixupKind::Cbnz: {
+        bool nonzero = fixup.kind == FixupKind::Cbnz;
+        if (!fixup.long_form) {
+          put((nonzero ? 0xB5000000 : 0xB4000000) |
+                  (scaled(offset, 19) << 5) | fixup.reg,
+              out);
+          break;
+        }
+        put((nonzero ? 0xB4000000 : 0xB5000000) | (scaled(8, 19) << 5) |
+                fixup.reg,
+            out);
+        TRY(put_b(offset - 4, out));
+        break;
+      }
+      case FixupKind::Tbz:
+      case FixupKind::Tbnz: {
+        bool nonzero = fixup.kind == FixupKind::Tbnz;
+        uint32_t bit = ((fixup.aux >> 5) << 31) | ((fixup.aux & 31) << 19);
+        if (!fixup.long_form) {
+          put((nonzero ? 0x37000000 : 0x36000000) | bit |
+                  (scaled(offset, 14) << 5) | fixup.reg,
+              out);
+          break;
+        }
+        put((nonzero ? 0x36000000 : 0x37000000) | bit |
+                (scaled(8, 14) << 5) | fixup.reg,
+            out);
+        TRY(put_b(offset - 4, out));
+        break;
+      }
+      case FixupKind::Adr: {
+        if (!fixup.long_form) {
+          put(encode_adr(0x10000000, fixup.reg, offset), out);
+          break;
+        }
+        absl::StatusOr<uint32_t> lo12 =
+            put_adrp(fixup.reg, base + from, base + to, out);
+        if (!lo12.ok()) return lo12.status();
+        put(0x91000000 | (*lo12 << 10) | (fixup.reg << 5) | fixup.reg, out);
+        break;
+      }
+      case FixupKind::LdrLiteral: {
+        if (!fixup.long_form) {
+          put(0x58000000 | (scaled(offset, 19) << 5) | fixup.reg, out);
+          break;
+        }
+        absl::StatusOr<uint32_t> lo12 =
+            put_adrp(fixup.reg, base + from, base + to, out);
+        if (!lo12.ok()) return lo12.status();
+        put(0xF9400000 | ((*lo12 / 8) << 10) | (fixup.reg << 5) | fixup.reg,
+            out);
+        break;
+      }
+    }
+  }
+  std::copy(code_.begin() + next, code_.end(), out);
+
+  if (!literals_.empty()) {
+    size_t end = code_.size() + growth_.back();
+    for (; end < pool_start(); ++end) {
+      out++ = 0;
+    }
+    for (uint64_t value : literals_) {
+      for (int i = 0; i < 8; ++i) {
+        out++ = (value >> (i * 8)) & 0xFF;
+      }
+    }
+  }
+
+  return absl::OkStatus();
+}
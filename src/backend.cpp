@@ -0,0 +1,66 @@
+#include "qream/backend.h"
+#include "qream/arm64.h"
+#include "qream/utils.h"
+#include "qream/x86_64.h"
+
+Backend host_backend() {
+#if defined(__aarch64__)
+  return Backend::Arm64;
+#elif defined(__x86_64__)
+  return Backend::X86_64;
+#else
+#error "no backend for this host architecture"
+#endif
+}
+
+absl::Status transpile(Backend backend, std::span<const Operation> ops,
+                       OutputIt &out, MemoryMode mem_mode) {
+  switch (backend) {
+    case Backend::Arm64:
+      return transpile_to_arm64(ops, out, mem_mode);
+    case Backend::X86_64:
+      return transpile_to_x86_64(ops, out, mem_mode);
+  }
+  return absl::InvalidArgumentError("unknown backend");
+}
+
+absl::StatusOr<std::vector<uint8_t>> transpile(
+    Backend backend, std::span<const Operation> ops, MemoryMode mem_mode) {
+  std::vector<uint8_t> code;
+  OutputIt out = std::back_inserter(code);
+  TRY(transpile(backend, ops, out, mem_mode));
+  return code;
+}
+
+std::vector<uint8_t> emit_trampoline(Backend backend) {
+  switch (backend) {
+    case Backend::Arm64:
+      return emit_arm64_trampoline();
+    case Backend::X86_64:
+      return emit_x86_64_trampoline();
+  }
+  return {};
+}
+
+bool patch_direct_jump(Backend backend, uint8_t *site,
+                       const uint8_t *target) {
+  switch (backend) {
+    case Backend::Arm64:
+      return patch_arm64_jump(site,
+                              target ? target : site + kArm64JumpSize);
+    case Backend::X86_64:
+      return patch_x86_64_jump(site,
+                               target ? target : site + kX86_64JumpSize);
+  }
+  return false;
+}
+
+size_t direct_jump_size(Backend backend) {
+  switch (backend) {
+    case Backend::Arm64:
+      return kArm64JumpSize;
+    case Backend::X86_64:
+      return kX86_64JumpSize;
+  }
+  return 0;
+}
@@ -0,0 +1,120 @@
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <utility>
+
+#include "qream/batch.h"
+
+namespace {
+
+// Regions a worker claims at a time; keeps the shared counter cold for
+// the typical tiny region.
+constexpr const size_t kRegionChunk = 64;
+
+} // namespace
+
+TranslationPool::TranslationPool(size_t threads)
+    : scratch_(std::max<size_t>(threads, 1)) {
+  for (size_t id = 0; id < scratch_.size(); ++id) {
+    workers_.emplace_back([this, id] { worker_loop(id); });
+  }
+}
+
+TranslationPool::~TranslationPool() {
+  {
+    std::lock_guard lock(mutex_);
+    stopping_ = true;
+  }
+  wake_.notify_all();
+  workers_.clear();
+}
+
+void TranslationPool::worker_loop(size_t id) {
+  uint64_t seen = 0;
+  while (true) {
+    {
+      std::unique_lock lock(mutex_);
+      wake_.wait(lock, [&] { return stopping_ || generation_ != seen; });
+      if (stopping_) return;
+      seen = generation_;
+    }
+
+    run_job(id);
+
+    std::lock_guard lock(mutex_);
+    if (--busy_ == 0) {
+      done_.notify_one();
+    }
+  }
+}
+
+void TranslationPool::run_job(size_t id) {
+  std::vector<uint8_t> &scratch = scratch_[id].code;
+  OutputIt out = std::back_inserter(scratch);
+
+  size_t count = job_.regions.size();
+  while (true) {
+    size_t begin = next_region_.fetch_add(kRegionChunk);
+    if (begin >= count) return;
+
+    for (size_t i = begin; i < std::min(begin + kRegionChunk, count); ++i) {
+      size_t start = scratch.size();
+      absl::Status status =
+          transpile(job_.backend, job_.regions[i], out, job_.mem_mode);
+      if (!status.ok()) {
+        scratch.resize(start);
+      }
+      job_.placements[i] = Placement{.worker = id,
+                                     .offset = start,
+                                     .size = scratch.size() - start,
+                                     .status = std::move(status)};
+    }
+  }
+}
+
+std::vector<RegionResult> TranslationPool::translate(
+    Backend backend, std::span<const std::span<const Operation>> regions,
+    std::vector<uint8_t> &out, MemoryMode mem_mode) {
+  std::vector<Placement> placements(regions.size());
+  for (Scratch &scratch : scratch_) {
+    scratch.code.clear();
+  }
+
+  {
+    std::lock_guard lock(mutex_);
+    job_ = Job{.backend = backend,
+               .mem_mode = mem_mode,
+               .regions = regions,
+               .placements = placements};
+    next_region_ = 0;
+    busy_ = workers_.size();
+    generation_++;
+  }
+  wake_.notify_all();
+
+  {
+    std::unique_lock lock(mutex_);
+    done_.wait(lock, [&] { return busy_ == 0; });
+  }
+
+  // lay the regions out in order, growing `out` once
+  std::vector<RegionResult> results(regions.size());
+  size_t offset = out.size();
+  for (size_t i = 0; i < regions.size(); ++i) {
+    results[i] = RegionResult{.status = std::move(placements[i].status),
+                              .offset = offset,
+                              .size = placements[i].size};
+    offset += placements[i].size;
+  }
+
+  out.resize(offset);
+  for (size_t i = 0; i < regions.size(); ++i) {
+    const Placement &placement = placements[i];
+    if (placement.size == 0) continue;
+    std::memcpy(out.data() + results[i].offset,
+                scratch_[placement.worker].code.data() + placement.offset,
+                placement.size);
+  }
+
+  return results;
+}
@@ -0,0 +1,335 @@
+#include <algorithm>
+#include <cstring>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <absl/status/status.h>
+
+#include "qream/code_cache.h"
+
+namespace {
+
+constexpr const size_t kBlockAlign = 16;
+constexpr const size_t kPageSize = 4096;
+// ARM64 long-form fixups go through ADRP, which only survives moves by
+// whole pages. They need a branch span of at least 1 MiB, so only blocks
+// this large are placed page-aligned.
+constexpr const size_t kLargeBlock = size_t{1} << 20;
+
+size_t block_align(size_t size) {
+  return size >= kLargeBlock ? kPageSize : kBlockAlign;
+}
+
+size_t align_size(size_t size) {
+  return (size + kBlockAlign - 1) & ~(kBlockAlign - 1);
+}
+
+uint8_t *align_up(uint8_t *ptr, size_t align) {
+  uint64_t addr = reinterpret_cast<uint64_t>(ptr);
+  return ptr + (((addr + align - 1) & ~(align - 1)) - addr);
+}
+
+void clear_cache(uint8_t *begin, size_t size) {
+  __builtin___clear_cache(reinterpret_cast<char *>(begin),
+                          reinterpret_cast<char *>(begin + size));
+}
+
+// mprotect granule; kPageSize is the ARM64 ADRP one
+size_t host_page_size() {
+  static const size_t page_size =
+      static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  return page_size;
+}
+
+uint8_t *page_down(uint8_t *ptr) {
+  return ptr - (reinterpret_cast<uint64_t>(ptr) & (host_page_size() - 1));
+}
+
+// Past this many separate ranges a mutation unseals the whole cache, so
+// a big flush can't split the mapping into too many pieces.
+constexpr const size_t kMaxUnsealedRanges = 64;
+
+} // namespace
+
+// Seals whatever the mutation it spans unsealed. Everything that writes
+// code runs inside one, between run slices.
+class CodeCache::WriteScope {
+ public:
+  explicit WriteScope(CodeCache &cache) : cache_(cache) {}
+  WriteScope(const WriteScope &) = delete;
+  WriteScope &operator=(const WriteScope &) = delete;
+  ~WriteScope() { cache_.seal(); }
+
+ private:
+  CodeCache &cache_;
+};
+
+absl::StatusOr<CodeCache> CodeCache::create(Backend backend,
+                                            CodeCacheOptions options) {
+  if (options.nursery_size == 0 || options.nursery_size >= options.budget) {
+    return absl::InvalidArgumentError(
+        "nursery must be a non-empty part of the budget");
+  }
+
+  // W^X: only writable inside a WriteScope
+  void *mem = mmap(nullptr, options.budget, PROT_READ | PROT_EXEC,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    return absl::ResourceExhaustedError("failed to map code cache");
+  }
+
+  return CodeCache(backend, options, static_cast<uint8_t *>(mem));
+}
+
+CodeCache::CodeCache(CodeCache &&other)
+    : backend_(other.backend_),
+      options_(other.options_),
+      mem_(std::exchange(other.mem_, nullptr)),
+      nursery_head_(other.nursery_head_),
+      old_head_(other.old_head_),
+      blocks_(std::move(other.blocks_)),
+      by_host_(std::move(other.by_host_)),
+      nursery_(std::move(other.nursery_)),
+      old_(std::move(other.old_)),
+      evicted_(std::move(other.evicted_)) {}
+
+CodeCache &CodeCache::operator=(CodeCache &&other) {
+  if (this != &other) {
+    if (mem_) munmap(mem_, options_.budget);
+    backend_ = other.backend_;
+    options_ = other.options_;
+    mem_ = std::exchange(other.mem_, nullptr);
+    nursery_head_ = other.nursery_head_;
+    old_head_ = other.old_head_;
+    blocks_ = std::move(other.blocks_);
+    by_host_ = std::move(other.by_host_);
+    nursery_ = std::move(other.nursery_);
+    old_ = std::move(other.old_);
+    evicted_ = std::move(other.evicted_);
+  }
+  return *this;
+}
+
+CodeCache::~CodeCache() {
+  if (mem_) munmap(mem_, options_.budget);
+}
+
+absl::StatusOr<const uint8_t *> CodeCache::insert(
+    uint64_t guest_addr, std::span<const uint8_t> code) {
+  size_t size = align_size(code.size());
+  size_t align = block_align(size);
+  if (align_up(mem_, align) + size > nursery_end()) {
+    return absl::InvalidArgumentError("block larger than the nursery");
+  }
+
+  WriteScope scope(*this);
+  if (blocks_.contains(guest_addr)) {
+    evict(guest_addr);
+    std::erase(nursery_, guest_addr);
+    std::erase(old_, guest_addr);
+  }
+
+  if (align_up(nursery_head_, align) + size > nursery_end()) {
+    flush_nursery();
+  }
+
+  uint8_t *host = align_up(nursery_head_, align);
+  if (!unseal(host, code.size())) {
+    return absl::InternalError("failed to make code cache writable");
+  }
+  nursery_head_ = host + size;
+  std::memcpy(host, code.data(), code.size());
+  clear_cache(host, code.size());
+
+  blocks_[guest_addr] = Block{.host = host, .size = size};
+  by_host_[host] = guest_addr;
+  nursery_.push_back(guest_addr);
+
+  if (!seal()) {
+    return absl::InternalError("failed to make code cache executable");
+  }
+  return host;
+}
+
+const uint8_t *CodeCache::lookup(uint64_t guest_addr) {
+  auto it = blocks_.find(guest_addr);
+  if (it == blocks_.end()) {
+    return nullptr;
+  }
+  it->second.hits++;
+  return it->second.host;
+}
+
+void CodeCache::link(uint8_t *site, uint64_t target) {
+  auto source_it = by_host_.upper_bound(site);
+  if (source_it == by_host_.begin()) return;
+  --source_it;
+
+  uint64_t source_addr = source_it->second;
+  Block &source = blocks_.at(source_addr);
+  if (site >= source.host + source.size) return;
+
+  auto target_it = blocks_.find(target);
+  if (target_it == blocks_.end()) return;
+  Block &dest = target_it->second;
+
+  WriteScope scope(*this);
+  if (!patch(site, dest.host)) return;
+
+  size_t offset = site - source.host;
+  source.outgoing.push_back(Link{target, offset});
+  dest.incoming.push_back(Link{source_addr, offset});
+  dest.hits++;
+}
+
+void CodeCache::flush_nursery() {
+  for (uint64_t guest_addr : std::exchange(nursery_, {})) {
+    const Block &block = blocks_.at(guest_addr);
+    bool live = block.hits >= options_.promote_after ||
+                !block.incoming.empty();
+    if (!live || !promote(guest_addr)) {
+      evict(guest_addr);
+    }
+  }
+
+  // covers the old location of promoted blocks too
+  evicted_.push_back(HostRange{mem_, nursery_end()});
+  nursery_head_ = mem_;
+}
+
+bool CodeCache::promote(uint64_t guest_addr) {
+  uint8_t *dst = alloc_old(blocks_.at(guest_addr).size);
+  if (!dst) return false;
+
+  Block &block = blocks_.at(guest_addr);
+  if (!unseal(dst, block.size)) return false;
+  std::memcpy(dst, block.host, block.size);
+  by_host_.erase(block.host);
+  block.host = dst;
+  block.hits = 0;
+  by_host_[dst] = guest_addr;
+
+  repatch(block, guest_addr);
+  clear_cache(dst, block.size);
+  old_.push_back(guest_addr);
+  return true;
+}
+
+uint8_t *CodeCache::alloc_old(size_t size) {
+  size_t align = block_align(size);
+  uint8_t *begin = align_up(nursery_end(), align);
+  if (begin + size > old_end()) {
+    return nullptr;
+  }
+
+  // wrap around, dropping whatever is left between the head and the end
+  uint8_t *host = align_up(old_head_, align);
+  if (host + size > old_end()) {
+    while (!old_.empty() && blocks_.at(old_.front()).host >= old_head_) {
+      evict(old_.front());
+      old_.pop_front();
+    }
+    old_head_ = host = begin;
+  }
+
+  // the oldest blocks sit right after the head
+  while (!old_.empty()) {
+    const uint8_t *front = blocks_.at(old_.front()).host;
+    if (front < old_head_ || front >= host + size) break;
+    evict(old_.front());
+    old_.pop_front();
+  }
+
+  old_head_ = host + size;
+  return host;
+}
+
+void CodeCache::repatch(Block &block, uint64_t guest_addr) {
+  // link sites are PC-relative, so both ends of every link moved relative
+  // to each other; unlink whatever no longer reaches
+  for (auto it = block.outgoing.begin(); it != block.outgoing.end();) {
+    Block &target = blocks_.at(it->guest);
+    if (patch(block.host + it->site, target.host)) {
+      ++it;
+      continue;
+    }
+    patch(block.host + it->site, nullptr);
+    std::erase(target.incoming, Link{guest_addr, it->site});
+    it = block.outgoing.erase(it);
+  }
+
+  for (auto it = block.incoming.begin(); it != block.incoming.end();) {
+    Block &source = blocks_.at(it->guest);
+    if (patch(source.host + it->site, block.host)) {
+      ++it;
+      continue;
+    }
+    patch(source.host + it->site, nullptr);
+    std::erase(source.outgoing, Link{guest_addr, it->site});
+    it = block.incoming.erase(it);
+  }
+}
+
+void CodeCache::evict(uint64_t guest_addr) {
+  auto it = blocks_.find(guest_addr);
+  if (it == blocks_.end()) return;
+
+  Block block = std::move(it->second);
+  blocks_.erase(it);
+  by_host_.erase(block.host);
+
+  for (const Link &in : block.incoming) {
+    auto source = blocks_.find(in.guest);
+    if (source == blocks_.end()) continue;
+    patch(source->second.host + in.site, nullptr);
+    std::erase(source->second.outgoing, Link{guest_addr, in.site});
+  }
+
+  for (const Link &out : block.outgoing) {
+    auto target = blocks_.find(out.guest);
+    if (target == blocks_.end()) continue;
+    std::erase(target->second.incoming, Link{guest_addr, out.site});
+  }
+
+  evicted_.push_back(HostRange{block.host, block.host + block.size});
+}
+
+bool CodeCache::unseal(uint8_t *begin, size_t size) {
+  if (unsealed_all_) return true;
+
+  uint8_t *first = page_down(begin);
+  uint8_t *last = page_down(begin + size + host_page_size() - 1);
+  // writes mostly land next to the previous one
+  if (!unsealed_.empty()) {
+    auto &[prev_first, prev_last] = unsealed_.back();
+    if (first >= prev_first && last <= prev_last) return true;
+  }
+
+  if (unsealed_.size() < kMaxUnsealedRanges &&
+      mprotect(first, last - first, PROT_READ | PROT_WRITE) == 0) {
+    unsealed_.emplace_back(first, last);
+    return true;
+  }
+  unsealed_all_ =
+      mprotect(mem_, options_.budget, PROT_READ | PROT_WRITE) == 0;
+  return unsealed_all_;
+}
+
+bool CodeCache::seal() {
+  bool sealed = true;
+  if (unsealed_all_) {
+    sealed = mprotect(mem_, options_.budget, PROT_READ | PROT_EXEC) == 0;
+  } else {
+    for (auto [first, last] : unsealed_) {
+      sealed &= mprotect(first, last - first, PROT_READ | PROT_EXEC) == 0;
+    }
+  }
+  unsealed_.clear();
+  unsealed_all_ = false;
+  return sealed;
+}
+
+bool CodeCache::patch(uint8_t *site, const uint8_t *target) {
+  return unseal(site, direct_jump_size(backend_)) &&
+         patch_direct_jump(backend_, site, target);
+}
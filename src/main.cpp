@@ -1,7 +1,7 @@
 #include "qream/ir.h"
-#include "qream/arm64.h"
-#include <sys/mman.h> // mmap, munmap, PROT_*, MAP_*
-#include <unistd.h>   // getpagesize, if needed
+#include "qream/backend.h"
+#include "qream/runtime.h"
+#include <cassert>
 
 #include <absl/base/log_severity.h>
 #include <iomanip>
@@ -9,6 +9,7 @@
 #include <absl/log/globals.h>
 #include <absl/log/initialize.h>
 #include <iostream>
+#include <utility>
 #include <vector>
 
 void print_hex(const std::vector<uint8_t> &code) {
@@ -51,62 +52,54 @@ int main() {
                 ScalarDType::Int64,
                 {Register{6, SizeClass(3)}, Register{1, SizeClass(3)}},
                 2},
+      Operation{5, IROp::Halt, VectorShape::Scalar, ScalarDType::Int64,
+                {}, 0},
   };
 
   for (const Operation &op : ops) {
     std::cerr << op << "\n";
   }
 
-  std::vector<uint8_t> code = transpile_to_arm64(ops);
+  Backend backend = host_backend();
+  absl::StatusOr<std::vector<uint8_t>> code = transpile(backend, ops);
+  if (!code.ok()) {
+    std::cerr << code.status() << "\n";
+    return 1;
+  }
   std::cout << "Machine code:\n";
-  print_hex(code);
-
-  uint32_t ret_instr = 0xD65F03C0; // RET
-  code.push_back(ret_instr & 0xFF);
-  code.push_back((ret_instr >> 8) & 0xFF);
-  code.push_back((ret_instr >> 16) & 0xFF);
-  code.push_back((ret_instr >> 24) & 0xFF);
-
-  void *mem = mmap(nullptr, code.size(), PROT_READ | PROT_WRITE,
-                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-  assert(mem != MAP_FAILED);
-  std::memcpy(mem, code.data(), code.size());
+  print_hex(*code);
 
-  mprotect(mem, code.size(), PROT_READ | PROT_EXEC);
+  std::vector<uint8_t> trampoline = emit_trampoline(backend);
+  absl::StatusOr<void *> entry = map_executable(trampoline);
+  absl::StatusOr<CodeCache> cache = CodeCache::create(backend);
+  assert(entry.ok() && cache.ok());
 
-  uint64_t x1 = 10, x2 = 3;
-  uint64_t x0, x3, x4, x5, x6;
+  VCpuState state;
+  state.regs[1] = 10;
+  state.regs[2] = 3;
 
-  asm volatile(
-      "mov x1, %0\n"
-      "mov x2, %1\n"
-      :
-      : "r"(x1), "r"(x2)
-      : "x1", "x2");
+  Dispatcher dispatcher(reinterpret_cast<EntryFn>(*entry),
+                        std::move(*cache));
+  absl::Status added = dispatcher.add_block(0, *code);
+  assert(added.ok());
 
-  using Fn = void (*)();
-  ((Fn)mem)();
+  absl::StatusOr<ExitReason> reason = dispatcher.run(state);
+  assert(reason.ok() && *reason == ExitReason::Halt);
 
-  asm volatile(
-      "mov %0, x7\n"
-      "mov %1, x3\n"
-      "mov %2, x4\n"
-      "mov %3, x5\n"
-      "mov %4, x6\n"
-      : "=r"(x0), "=r"(x3), "=r"(x4), "=r"(x5), "=r"(x6));
+  uint64_t x1 = state.regs[1], x2 = state.regs[2];
 
-  std::cout << "x7 (add): " << x0 << "\n"; // 13
-  std::cout << "x3 (sub): " << x3 << "\n"; // 7
-  std::cout << "x4 (mul): " << x4 << "\n"; // 30
-  std::cout << "x5 (xor): " << x5 << "\n"; // 9 ^ 3 = 9
-  std::cout << "x6 (neg): " << x6 << "\n"; // -10
+  std::cout << "x7 (add): " << state.regs[7] << "\n"; // 13
+  std::cout << "x3 (sub): " << state.regs[3] << "\n"; // 7
+  std::cout << "x4 (mul): " << state.regs[4] << "\n"; // 30
+  std::cout << "x5 (xor): " << state.regs[5] << "\n"; // 9 ^ 3 = 9
+  std::cout << "x6 (neg): " << state.regs[6] << "\n"; // -10
 
-  assert(x0 == 13);
-  assert(x3 == 7);
-  assert(x4 == 30);
-  assert(x5 == (x1 ^ x2));
-  assert(x6 == (uint64_t)-10);
+  assert(state.regs[7] == 13);
+  assert(state.regs[3] == 7);
+  assert(state.regs[4] == 30);
+  assert(state.regs[5] == (x1 ^ x2));
+  assert(state.regs[6] == (uint64_t)-10);
 
   std::cout << "All tests passed.\n";
-  munmap(mem, code.size());
+  unmap_executable(*entry, trampoline.size());
 }
@@ -0,0 +1,104 @@
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <absl/status/status.h>
+#include <absl/strings/str_format.h>
+
+#include "qream/memory.h"
+
+namespace {
+
+constexpr const size_t kWindowReservation = kFlatWindowSize + kFlatGuardSize;
+
+int to_prot(SegmentFlags flags) {
+  int prot = PROT_READ | PROT_WRITE;
+  if (flags.read_only) {
+    prot = PROT_READ;
+  }
+  if (flags.executable) {
+    prot |= PROT_EXEC;
+  }
+  return prot;
+}
+
+} // namespace
+
+GuestMemory &GuestMemory::operator=(GuestMemory &&other) {
+  if (this != &other) {
+    if (window_base) munmap(window_base, kWindowReservation);
+    resolve = other.resolve;
+    mode = other.mode;
+    window_base = std::exchange(other.window_base, nullptr);
+    segments = std::move(other.segments);
+  }
+  return *this;
+}
+
+GuestMemory::~GuestMemory() {
+  // segments inside the window go away with it
+  if (window_base) munmap(window_base, kWindowReservation);
+}
+
+absl::StatusOr<GuestMemory> GuestMemory::flat() {
+  void *window = mmap(nullptr, kWindowReservation, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (window == MAP_FAILED) {
+    return absl::ResourceExhaustedError(
+        "failed to reserve flat guest address window");
+  }
+
+  GuestMemory mem;
+  mem.mode = MemoryMode::Flat;
+  mem.window_base = static_cast<uint8_t *>(window);
+  return mem;
+}
+
+absl::StatusOr<AllocatedSegment> GuestMemory::mapInto(
+    uint64_t guest_base, size_t length, SegmentFlags flags) {
+  size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  size_t aligned_length = (length + page_size - 1) & ~(page_size - 1);
+  if (aligned_length == 0 || aligned_length < length) {
+    return absl::InvalidArgumentError("bad segment length");
+  }
+  if (guest_base + aligned_length < guest_base) {
+    return absl::InvalidArgumentError("segment wraps the address space");
+  }
+  for (const AllocatedSegment &seg : segments) {
+    if (guest_base < seg.guest_base + seg.length &&
+        seg.guest_base < guest_base + aligned_length) {
+      return absl::AlreadyExistsError(absl::StrFormat(
+          "segment at 0x%x overlaps the one at 0x%x", guest_base,
+          seg.guest_base));
+    }
+  }
+
+  void *mem;
+  if (mode == MemoryMode::Flat) {
+    // MAP_FIXED replaces whatever is there, so nothing may reach past
+    // the window
+    if (guest_base % page_size != 0) {
+      return absl::InvalidArgumentError(
+          "flat segments must be page aligned");
+    }
+    if (aligned_length > kFlatWindowSize ||
+        guest_base > kFlatWindowSize - aligned_length) {
+      return absl::OutOfRangeError(absl::StrFormat(
+          "segment at 0x%x doesn't fit the flat window", guest_base));
+    }
+    mem = mmap(window_base + guest_base, aligned_length, to_prot(flags),
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+  } else {
+    mem = mmap(nullptr, aligned_length, to_prot(flags),
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  }
+  if (mem == MAP_FAILED) {
+    return absl::ResourceExhaustedError("failed to map guest segment");
+  }
+
+  AllocatedSegment seg{.guest_base = guest_base,
+                       .mem = mem,
+                       .length = aligned_length,
+                       .flags = flags};
+  segments.push_back(seg);
+  return seg;
+}
@@ -0,0 +1,85 @@
+#include <atomic>
+#include <cstring>
+#include <utility>
+#include <sys/mman.h>
+
+#include <absl/status/status.h>
+#include <absl/status/statusor.h>
+#include <absl/strings/str_format.h>
+
+#include "qream/runtime.h"
+
+absl::StatusOr<void *> map_executable(std::span<const uint8_t> code) {
+  void *mem = mmap(nullptr, code.size(), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    return absl::ResourceExhaustedError("failed to map code buffer");
+  }
+
+  std::memcpy(mem, code.data(), code.size());
+
+  if (mprotect(mem, code.size(), PROT_READ | PROT_EXEC) != 0) {
+    munmap(mem, code.size());
+    return absl::InternalError("failed to make code buffer executable");
+  }
+
+  __builtin___clear_cache(static_cast<char *>(mem),
+                          static_cast<char *>(mem) + code.size());
+  return mem;
+}
+
+void unmap_executable(void *mem, size_t length) { munmap(mem, length); }
+
+namespace {
+
+// Epochs are unique across dispatchers, so a state moved between them
+// never looks up to date.
+uint64_t next_epoch() {
+  static std::atomic<uint64_t> epoch = 1;
+  return epoch.fetch_add(1, std::memory_order_relaxed);
+}
+
+} // namespace
+
+Dispatcher::Dispatcher(EntryFn enter, CodeCache cache)
+    : enter_(enter), cache_(std::move(cache)), epoch_(next_epoch()) {}
+
+absl::Status Dispatcher::add_block(uint64_t guest_addr,
+                                   std::span<const uint8_t> code) {
+  absl::StatusOr<const uint8_t *> host = cache_.insert(guest_addr, code);
+  if (!cache_.take_evicted().empty()) {
+    epoch_ = next_epoch();
+  }
+  return host.status();
+}
+
+absl::StatusOr<ExitReason> Dispatcher::run(VCpuState &state) {
+  if (state.cache_epoch != epoch_) {
+    state.ibtc.flush();
+    state.ras.flush();
+    state.cache_epoch = epoch_;
+  }
+
+  while (true) {
+    // Only the direct jump that exited just now may be chained to `pc`;
+    // a miss must not leave it for whatever pc the next run starts at.
+    uint64_t site = std::exchange(state.link_site, 0);
+    const uint8_t *host = cache_.lookup(state.pc);
+    if (!host) {
+      return absl::NotFoundError(
+          absl::StrFormat("no translation for guest pc 0x%x", state.pc));
+    }
+    if (site != 0) {
+      cache_.link(reinterpret_cast<uint8_t *>(site), state.pc);
+    }
+
+    // seed the branch cache so the next indirect jump here stays inside
+    // generated code
+    state.ibtc.insert(state.pc, reinterpret_cast<uint64_t>(host));
+
+    ExitReason reason = enter_(&state, host);
+    if (reason != ExitReason::LookupMiss) {
+      return reason;
+    }
+  }
+}
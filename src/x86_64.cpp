@@ -0,0 +1,552 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <optional>
+#include <vector>
+#include <absl/status/statusor.h>
+#include <absl/strings/str_format.h>
+
+#include "qream/env.h"
+#include "qream/ir.h"
+#include "qream/match.h"
+#include "qream/memory.h"
+#include "qream/runtime.h"
+#include "qream/utils.h"
+#include "qream/x86_64.h"
+
+namespace {
+
+// Guest registers live in VCpuState::regs rather than host registers;
+// rax, rcx and rdx are scratch.
+constexpr const uint32_t kRax = 0;
+constexpr const uint32_t kRcx = 1;
+constexpr const uint32_t kRdx = 2;
+constexpr const uint32_t kRbx = 3;
+constexpr const uint32_t kRsp = 4;
+constexpr const uint32_t kRbp = 5;
+constexpr const uint32_t kRsi = 6;
+constexpr const uint32_t kRdi = 7;
+constexpr const uint32_t kR12 = 12;
+constexpr const uint32_t kR13 = 13;
+constexpr const uint32_t kMemBaseReg = 14; // r14: flat window base
+constexpr const uint32_t kStateReg = 15;   // r15: VCpuState *
+
+constexpr bool is_guest_reg(uint32_t enc) {
+  return enc < std::tuple_size_v<decltype(VCpuState::regs)>;
+}
+
+int32_t reg_slot(uint32_t enc) {
+  return offsetof(VCpuState, regs) + enc * sizeof(uint64_t);
+}
+
+inline void emit_byte(uint8_t b, OutputIt &out) { out++ = b; }
+
+inline void emit_imm32(uint32_t imm, OutputIt &out) {
+  for (int i = 0; i < 4; ++i) {
+    out++ = (imm >> (i * 8)) & 0xFF;
+  }
+}
+
+inline void emit_imm64(uint64_t imm, OutputIt &out) {
+  for (int i = 0; i < 8; ++i) {
+    out++ = (imm >> (i * 8)) & 0xFF;
+  }
+}
+
+// [REX] opcode ModRM with a register r/m operand.
+void emit_reg_op(std::initializer_list<uint8_t> opcode, bool wide,
+                 uint32_t reg, uint32_t rm, OutputIt &out) {
+  uint8_t rex = 0x40 | (wide << 3) | ((reg & 8) >> 1) | ((rm & 8) >> 3);
+  if (rex != 0x40) emit_byte(rex, out);
+  for (uint8_t b : opcode) emit_byte(b, out);
+  emit_byte(0xC0 | ((reg & 7) << 3) | (rm & 7), out);
+}
+
+// [REX] opcode ModRM [SIB] [disp] with a [base + index + disp] operand.
+void emit_mem_op(std::initializer_list<uint8_t> opcode, bool wide,
+                 uint32_t reg, uint32_t base, std::optional<uint32_t> index,
+                 int32_t disp, OutputIt &out) {
+  uint8_t rex = 0x40 | (wide << 3) | ((reg & 8) >> 1) |
+                ((index.value_or(0) & 8) >> 2) | ((base & 8) >> 3);
+  if (rex != 0x40) emit_byte(rex, out);
+  for (uint8_t b : opcode) emit_byte(b, out);
+
+  // rbp/r13 as base can't go without a displacement
+  uint8_t mod = 0b10;
+  if (disp == 0 && (base & 7) != kRbp) {
+    mod = 0b00;
+  } else if (disp >= -128 && disp < 128) {
+    mod = 0b01;
+  }
+
+  bool sib = index || (base & 7) == kRsp;
+  emit_byte((mod << 6) | ((reg & 7) << 3) | (sib ? 0b100 : (base & 7)), out);
+  if (sib) {
+    emit_byte(((index.value_or(kRsp) & 7) << 3) | (base & 7), out);
+  }
+
+  if (mod == 0b01) {
+    emit_byte(static_cast<uint8_t>(disp), out);
+  } else if (mod == 0b10) {
+    emit_imm32(static_cast<uint32_t>(disp), out);
+  }
+}
+
+inline void emit_load(uint32_t reg, uint32_t base, int32_t disp,
+                      OutputIt &out) {
+  emit_mem_op({0x8B}, true, reg, base, std::nullopt, disp, out);
+}
+
+inline void emit_store(uint32_t reg, uint32_t base, int32_t disp,
+                       OutputIt &out) {
+  emit_mem_op({0x89}, true, reg, base, std::nullopt, disp, out);
+}
+
+// MOV r64, imm; the 32-bit form zero-extends when the value allows it.
+void emit_mov_imm(uint32_t reg, uint64_t imm, OutputIt &out) {
+  if (imm <= 0xFFFFFFFF) {
+    if (reg & 8) emit_byte(0x41, out);
+    emit_byte(0xB8 | (reg & 7), out);
+    emit_imm32(imm, out);
+    return;
+  }
+  emit_byte(0x48 | ((reg & 8) >> 3), out);
+  emit_byte(0xB8 | (reg & 7), out);
+  emit_imm64(imm, out);
+}
+
+// Group-1 ALU op (`ext` selects ADD/AND/...) against a 32-bit immediate.
+inline void emit_alu_imm32(uint32_t ext, bool wide, uint32_t reg,
+                           uint32_t imm, OutputIt &out) {
+  emit_reg_op({0x81}, wide, ext, reg, out);
+  emit_imm32(imm, out);
+}
+
+inline void emit_shl_imm(uint32_t reg, uint8_t amount, OutputIt &out) {
+  emit_reg_op({0xC1}, true, 4, reg, out);
+  emit_byte(amount, out);
+}
+
+// Jcc rel8 to a later point; returns the end of the jump, for
+// `bind_rel8`.
+size_t emit_jcc_forward(uint8_t opcode, std::vector<uint8_t> &code) {
+  code.push_back(opcode);
+  code.push_back(0);
+  return code.size();
+}
+
+// Points the rel8 / rel32 displacement that ends at `end` at the end of
+// the code so far.
+void bind_rel8(std::vector<uint8_t> &code, size_t end) {
+  code[end - 1] = static_cast<uint8_t>(code.size() - end);
+}
+
+void bind_rel32(std::vector<uint8_t> &code, size_t end) {
+  uint32_t rel = static_cast<uint32_t>(code.size() - end);
+  std::memcpy(code.data() + end - sizeof(rel), &rel, sizeof(rel));
+}
+
+constexpr const uint8_t kJz = 0x74;
+constexpr const uint8_t kJne = 0x75;
+
+// LEA r64, [rip + rel], relative to the end of the LEA.
+inline void emit_lea_rip(uint32_t reg, int32_t rel, OutputIt &out) {
+  emit_byte(0x48 | ((reg & 8) >> 1), out);
+  emit_byte(0x8D, out);
+  emit_byte(((reg & 7) << 3) | 0b101, out);
+  emit_imm32(static_cast<uint32_t>(rel), out);
+}
+
+inline void emit_push(uint32_t reg, OutputIt &out) {
+  if (reg & 8) emit_byte(0x41, out);
+  emit_byte(0x50 | (reg & 7), out);
+}
+
+inline void emit_pop(uint32_t reg, OutputIt &out) {
+  if (reg & 8) emit_byte(0x41, out);
+  emit_byte(0x58 | (reg & 7), out);
+}
+
+inline void emit_ret(OutputIt &out) { emit_byte(0xC3, out); }
+
+// Stores `reason` into the vCPU state and returns to the dispatcher.
+void emit_exit(ExitReason reason, OutputIt &out) {
+  emit_mem_op({0xC7}, true, 0, kStateReg, std::nullopt,
+              offsetof(VCpuState, exit_reason), out);
+  emit_imm32(static_cast<uint32_t>(reason), out);
+  emit_ret(out);
+}
+
+// Jumps through the branch table slot selected by rcx (already scaled)
+// when its guest address matches rax; falls through otherwise. With
+// `check_host`, a slot without host code falls through too.
+void emit_probe(int32_t entries_offset, bool check_host,
+                std::vector<uint8_t> &code) {
+  OutputIt out = std::back_inserter(code);
+  emit_mem_op({0x3B}, true, kRax, kStateReg, kRcx,
+              entries_offset + offsetof(BranchTarget, guest), out);
+  size_t miss = emit_jcc_forward(kJne, code);
+
+  if (check_host) {
+    emit_mem_op({0x8B}, true, kRdx, kStateReg, kRcx,
+                entries_offset + offsetof(BranchTarget, host), out);
+    emit_reg_op({0x85}, true, kRdx, kRdx, out);
+    size_t empty = emit_jcc_forward(kJz, code);
+    emit_reg_op({0xFF}, false, 4, kRdx, out);
+    bind_rel8(code, empty);
+  } else {
+    emit_mem_op({0xFF}, false, 4, kStateReg, kRcx,
+                entries_offset + offsetof(BranchTarget, host), out);
+  }
+
+  bind_rel8(code, miss);
+}
+
+// Inline probe of the indirect branch cache for the guest address in
+// rax. Falls back to the dispatcher with `pc` set on a miss.
+void emit_ibtc_lookup(std::vector<uint8_t> &code) {
+  OutputIt out = std::back_inserter(code);
+  emit_reg_op({0x89}, true, kRax, kRcx, out);
+  emit_alu_imm32(4, false, kRcx, kIbtcEntries - 1, out);
+  emit_shl_imm(kRcx, 4, out);
+  // empty slots never match, see IndirectBranchCache::empty
+  emit_probe(kIbtcEntriesOffset, /*check_host=*/false, code);
+  // miss
+  emit_store(kRax, kStateReg, offsetof(VCpuState, pc), out);
+  emit_exit(ExitReason::LookupMiss, out);
+}
+
+struct OpEmitter {
+  // code goes through a buffer so forward jumps can be patched in place
+  std::vector<uint8_t> &code;
+  OutputIt &out;
+  Env &env;
+  // return address of a Call that ends the region so far
+  std::optional<uint64_t> fallthrough;
+
+  absl::Status emit_binary_op(const Operation &op,
+                              std::initializer_list<uint8_t> opcode) {
+    return MATCH_OP(Int64, Scalar, Register, Register, Register)(
+        op,
+        [opcode](const Operation &, const Register &dst,
+                 const Register &lhs, const Register &rhs, OutputIt &out) {
+          emit_load(kRax, kStateReg, reg_slot(lhs.enc), out);
+          emit_mem_op(opcode, true, kRax, kStateReg, std::nullopt,
+                      reg_slot(rhs.enc), out);
+          emit_store(kRax, kStateReg, reg_slot(dst.enc), out);
+        },
+        out);
+  }
+
+  absl::Status emit_neg(const Operation &op) {
+    return MATCH_OP(Int64, Scalar, Register, Register)(
+        op,
+        [](const Operation &, const Register &dst, const Register &src,
+           OutputIt &out) {
+          emit_load(kRax, kStateReg, reg_slot(src.enc), out);
+          emit_reg_op({0xF7}, true, 3, kRax, out);
+          emit_store(kRax, kStateReg, reg_slot(dst.enc), out);
+        },
+        out);
+  }
+
+  // Leaves base + index + offset in rcx. Flat mode uses 32-bit
+  // arithmetic, which wraps like the guest's and zero-extends rcx for
+  // [base + rcx]; segmented mode computes a full host address, since the
+  // guest registers hold one.
+  void emit_address(const MemoryAddressing &mem, OutputIt &out) {
+    bool wide = env.mem_mode != MemoryMode::Flat;
+    uint64_t offset = wide ? mem.offset : static_cast<uint32_t>(mem.offset);
+
+    std::optional<Register> first = mem.base_reg ? mem.base_reg : mem.index;
+    std::optional<Register> second =
+        mem.base_reg ? mem.index : std::nullopt;
+    if (!first) {
+      emit_mov_imm(kRcx, offset, out);
+      return;
+    }
+
+    emit_mem_op({0x8B}, wide, kRcx, kStateReg, std::nullopt,
+                reg_slot(first->enc), out);
+    if (second) {
+      emit_mem_op({0x03}, wide, kRcx, kStateReg, std::nullopt,
+                  reg_slot(second->enc), out);
+    }
+
+    // the imm32 form sign-extends in 64-bit arithmetic
+    int64_t signed_offset = static_cast<int64_t>(offset);
+    if (offset == 0) return;
+    if (!wide ||
+        (signed_offset >= INT32_MIN && signed_offset <= INT32_MAX)) {
+      emit_alu_imm32(0, wide, kRcx, static_cast<uint32_t>(offset), out);
+    } else {
+      emit_mov_imm(kRdx, offset, out);
+      emit_reg_op({0x03}, true, kRcx, kRdx, out);
+    }
+  }
+
+  void emit_access(uint8_t opcode, const MemoryAddressing &mem,
+                   OutputIt &out) {
+    emit_address(mem, out);
+    if (env.mem_mode == MemoryMode::Flat) {
+      emit_mem_op({opcode}, true, kRax, kMemBaseReg, kRcx, 0, out);
+    } else {
+      emit_mem_op({opcode}, true, kRax, kRcx, std::nullopt, 0, out);
+    }
+  }
+
+  absl::Status emit_mov_imm_to_reg(const Operation &op) {
+    return MATCH_OP(Int64, Scalar, Imm64, Register)(
+        op,
+        [](const Operation &, const Imm64 &imm, const Register &rt,
+           OutputIt &out) {
+          emit_mov_imm(kRax, imm, out);
+          emit_store(kRax, kStateReg, reg_slot(rt.enc), out);
+        },
+        out);
+  }
+
+  absl::Status emit_ldr(const Operation &op) {
+    RETURN_IF_OK(MATCH_OP(Int64, Scalar, MemoryAddressing, Register)(
+        op,
+        [this](const Operation &, const MemoryAddressing &mem,
+               const Register &rt, OutputIt &out) {
+          emit_access(0x8B, mem, out);
+          emit_store(kRax, kStateReg, reg_slot(rt.enc), out);
+        },
+        out));
+
+    return emit_mov_imm_to_reg(op);
+  }
+
+  absl::Status emit_str(const Operation &op) {
+    RETURN_IF_OK(MATCH_OP(Int64, Scalar, MemoryAddressing, Register)(
+        op,
+        [this](const Operation &, const MemoryAddressing &mem,
+               const Register &rt, OutputIt &out) {
+          emit_load(kRax, kStateReg, reg_slot(rt.enc), out);
+          emit_access(0x89, mem, out);
+        },
+        out));
+
+    return emit_mov_imm_to_reg(op);
+  }
+
+  absl::Status emit_jump(const Operation &op) {
+    RETURN_IF_OK(MATCH_OP(Int64, Scalar, Register)(
+        op,
+        [this](const Operation &, const Register &target, OutputIt &out) {
+          emit_load(kRax, kStateReg, reg_slot(target.enc), out);
+          emit_ibtc_lookup(code);
+        },
+        out));
+
+    return MATCH_OP(Int64, Scalar, Imm64)(
+        op,
+        [this](const Operation &, const Imm64 &target, OutputIt &) {
+          emit_direct_jump(target);
+        },
+        out);
+  }
+
+  // Direct jumps exit through a link site: a JMP to the next instruction
+  // that the code cache repoints at the target once it's translated.
+  void emit_direct_jump(uint64_t target) {
+    size_t site = code.size();
+    emit_byte(0xE9, out);
+    emit_imm32(0, out);
+
+    emit_mov_imm(kRax, target, out);
+    emit_store(kRax, kStateReg, offsetof(VCpuState, pc), out);
+
+    // rax = the link site, from the end of this LEA
+    constexpr const size_t kLeaSize = 7;
+    size_t back = code.size() + kLeaSize - site;
+    emit_lea_rip(kRax, -static_cast<int32_t>(back), out);
+    emit_store(kRax, kStateReg, offsetof(VCpuState, link_site), out);
+    emit_exit(ExitReason::LookupMiss, out);
+  }
+
+  // Pushes (return_addr, host continuation) onto the shadow return stack.
+  // The caller emits the transfer, then `bind_rel32`s the returned LEA
+  // displacement to where the continuation starts.
+  size_t emit_ras_push(uint64_t return_addr) {
+    emit_load(kRcx, kStateReg, kRasTopOffset, out);
+    emit_reg_op({0x83}, true, 0, kRcx, out); // add rcx, 1
+    emit_byte(1, out);
+    emit_alu_imm32(4, false, kRcx, kRasDepth - 1, out);
+    emit_store(kRcx, kStateReg, kRasTopOffset, out);
+    emit_shl_imm(kRcx, 4, out);
+
+    emit_mov_imm(kRax, return_addr, out);
+    emit_mem_op({0x89}, true, kRax, kStateReg, kRcx,
+                kRasEntriesOffset + offsetof(BranchTarget, guest), out);
+
+    emit_lea_rip(kRax, 0, out);
+    size_t cont = code.size();
+    emit_mem_op({0x89}, true, kRax, kStateReg, kRcx,
+                kRasEntriesOffset + offsetof(BranchTarget, host), out);
+    return cont;
+  }
+
+  absl::Status emit_call(const Operation &op) {
+    // Call target, return_addr
+    RETURN_IF_OK(MATCH_OP(Int64, Scalar, Register, Imm64)(
+        op,
+        [this](const Operation &, const Register &target,
+               const Imm64 &return_addr, OutputIt &out) {
+          size_t cont = emit_ras_push(return_addr);
+          emit_load(kRax, kStateReg, reg_slot(target.enc), out);
+          emit_ibtc_lookup(code);
+          bind_rel32(code, cont);
+          fallthrough = return_addr;
+        },
+        out));
+
+    return MATCH_OP(Int64, Scalar, Imm64, Imm64)(
+        op,
+        [this](const Operation &, const Imm64 &target,
+               const Imm64 &return_addr, OutputIt &out) {
+          size_t cont = emit_ras_push(return_addr);
+          emit_mov_imm(kRax, target, out);
+          emit_ibtc_lookup(code);
+          bind_rel32(code, cont);
+          fallthrough = return_addr;
+        },
+        out);
+  }
+
+  absl::Status emit_ret(const Operation &op) {
+    // Pop the shadow stack and jump straight to the host continuation if
+    // it predicted this return; otherwise probe the branch cache.
+    return MATCH_OP(Int64, Scalar, Register)(
+        op,
+        [this](const Operation &, const Register &target, OutputIt &out) {
+          emit_load(kRax, kStateReg, reg_slot(target.enc), out);
+          emit_load(kRcx, kStateReg, kRasTopOffset, out);
+          emit_mem_op({0x8D}, true, kRdx, kRcx, std::nullopt, -1, out);
+          emit_alu_imm32(4, false, kRdx, kRasDepth - 1, out);
+          emit_store(kRdx, kStateReg, kRasTopOffset, out);
+          emit_shl_imm(kRcx, 4, out);
+          emit_probe(kRasEntriesOffset, /*check_host=*/true, code);
+          emit_ibtc_lookup(code);
+        },
+        out);
+  }
+
+  absl::Status emit_halt(const Operation &op) {
+    emit_mov_imm(kRax, op.addr, out);
+    emit_store(kRax, kStateReg, offsetof(VCpuState, pc), out);
+    emit_exit(ExitReason::Halt, out);
+    return absl::OkStatus();
+  }
+
+  absl::Status try_emit(const Operation &op) {
+    TRY(check_registers(op, is_guest_reg));
+    fallthrough.reset();
+    switch (op.irop) {
+      case IROp::Add:
+        return emit_binary_op(op, {0x03});
+      case IROp::Sub:
+        return emit_binary_op(op, {0x2B});
+      case IROp::Mul:
+        return emit_binary_op(op, {0x0F, 0xAF});
+      case IROp::And:
+        return emit_binary_op(op, {0x23});
+      case IROp::Or:
+        return emit_binary_op(op, {0x0B});
+      case IROp::Xor:
+        return emit_binary_op(op, {0x33});
+      case IROp::Neg:
+        return emit_neg(op);
+      case IROp::Ldr:
+        return emit_ldr(op);
+      case IROp::Str:
+        return emit_str(op);
+      case IROp::Jump:
+        return emit_jump(op);
+      case IROp::Call:
+        return emit_call(op);
+      case IROp::Ret:
+        return emit_ret(op);
+      case IROp::Halt:
+        return emit_halt(op);
+      default:
+        return absl::InternalError(
+            absl::StrFormat("%s not implemented", op.toString()));
+    }
+  }
+
+  // A predicted Ret lands right after its Call, so a region ending in one
+  // continues to the return address from there.
+  void finish() {
+    if (fallthrough) {
+      emit_direct_jump(*fallthrough);
+    }
+  }
+};
+
+} // namespace
+
+std::vector<uint8_t> emit_x86_64_trampoline() {
+  std::vector<uint8_t> code;
+  OutputIt out = std::back_inserter(code);
+
+  // ExitReason enter(VCpuState *state /* rdi */, const void *code /* rsi */)
+  for (uint32_t reg : {kRbx, kRbp, kR12, kR13, kMemBaseReg, kStateReg}) {
+    emit_push(reg, out);
+  }
+
+  emit_reg_op({0x89}, true, kRdi, kStateReg, out);
+  emit_load(kMemBaseReg, kStateReg, offsetof(VCpuState, mem_base), out);
+
+  // six pushes on top of our return address leave rsp 8 off the 16-byte
+  // alignment the SysV ABI wants at a call
+  emit_reg_op({0x83}, true, 5, kRsp, out); // sub rsp, 8
+  emit_byte(8, out);
+
+  // generated code leaves with RET, which lands right after this
+  emit_reg_op({0xFF}, false, 2, kRsi, out);
+
+  emit_reg_op({0x83}, true, 0, kRsp, out); // add rsp, 8
+  emit_byte(8, out);
+
+  emit_load(kRax, kStateReg, offsetof(VCpuState, exit_reason), out);
+  for (uint32_t reg : {kStateReg, kMemBaseReg, kR13, kR12, kRbp, kRbx}) {
+    emit_pop(reg, out);
+  }
+  emit_ret(out);
+
+  return code;
+}
+
+bool patch_x86_64_jump(uint8_t *site, const uint8_t *target) {
+  int64_t rel = target - (site + kX86_64JumpSize);
+  if (rel < INT32_MIN || rel > INT32_MAX) {
+    return false;
+  }
+
+  int32_t rel32 = static_cast<int32_t>(rel);
+  std::memcpy(site + 1, &rel32, sizeof(rel32));
+  return true;
+}
+
+absl::Status transpile_to_x86_64(std::span<const Operation> ops,
+                                 OutputIt &out, MemoryMode mem_mode) {
+  // one per thread, so it's reused from block to block
+  thread_local std::vector<uint8_t> code;
+  code.clear();
+  OutputIt code_out = std::back_inserter(code);
+
+  Env env{0, mem_mode};
+  OpEmitter emitter{code, code_out, env};
+
+  for (const Operation &op : ops) {
+    TRY(explain_mismatch(emitter.try_emit(op), op));
+  }
+  emitter.finish();
+
+  std::copy(code.begin(), code.end(), out);
+  return absl::OkStatus();
+}
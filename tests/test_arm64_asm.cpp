@@ -0,0 +1,222 @@
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "qream/arm64_asm.h"
+
+namespace {
+
+constexpr const uint32_t kNop = 0xD503201F;
+
+void pad(Arm64Assembler &as, size_t bytes) {
+  for (size_t i = 0; i < bytes; i += 4) {
+    uint32_t instr = kNop;
+    for (int b = 0; b < 4; ++b) {
+      as.out()++ = (instr >> (b * 8)) & 0xFF;
+    }
+  }
+}
+
+std::vector<uint8_t> finish(Arm64Assembler &as, uint64_t base = 0) {
+  std::vector<uint8_t> code;
+  OutputIt out = std::back_inserter(code);
+  absl::Status status = as.finish(base, out);
+  EXPECT_TRUE(status.ok()) << status;
+  return code;
+}
+
+uint32_t word(const std::vector<uint8_t> &code, size_t pos) {
+  uint32_t instr;
+  std::memcpy(&instr, code.data() + pos, sizeof(instr));
+  return instr;
+}
+
+int64_t sign_extend(uint64_t value, int bits) {
+  uint64_t sign = uint64_t{1} << (bits - 1);
+  return static_cast<int64_t>((value ^ sign) - sign);
+}
+
+// Byte offset of a B / B.cond / CBZ / TBZ at `pos`.
+int64_t b_offset(uint32_t instr) {
+  return sign_extend(instr & 0x3FFFFFF, 26) * 4;
+}
+int64_t imm19_offset(uint32_t instr) {
+  return sign_extend((instr >> 5) & 0x7FFFF, 19) * 4;
+}
+int64_t imm14_offset(uint32_t instr) {
+  return sign_extend((instr >> 5) & 0x3FFF, 14) * 4;
+}
+// Page delta of an ADRP.
+int64_t adrp_pages(uint32_t instr) {
+  uint64_t imm = (((instr >> 5) & 0x7FFFF) << 2) | ((instr >> 29) & 3);
+  return sign_extend(imm, 21);
+}
+
+bool is_b(uint32_t instr) { return (instr & 0xFC000000) == 0x14000000; }
+bool is_adrp(uint32_t instr) { return (instr & 0x9F000000) == 0x90000000; }
+
+TEST(Arm64Assembler, ShortFormsStayShort) {
+  Arm64Assembler as;
+  Label target = as.new_label();
+  as.tbz(3, 5, target);
+  as.b_cond(Cond::NE, target);
+  pad(as, 1024);
+  as.bind(target);
+
+  std::vector<uint8_t> code = finish(as);
+  ASSERT_EQ(code.size(), 8 + 1024);
+  EXPECT_EQ(word(code, 0) & 0xFF00001F, 0x36000003u); // tbz w3
+  EXPECT_EQ((word(code, 0) >> 19) & 0x1F, 5u);
+  EXPECT_EQ(imm14_offset(word(code, 0)), 8 + 1024);
+  EXPECT_EQ(word(code, 4) & 0xFF00001F, 0x54000001u); // b.ne
+  EXPECT_EQ(imm19_offset(word(code, 4)), 4 + 1024);
+}
+
+TEST(Arm64Assembler, TbzPastRangeBecomesInvertedSkip) {
+  Arm64Assembler as;
+  Label target = as.new_label();
+  as.tbz(3, 40, target);
+  pad(as, 40 << 10);
+  as.bind(target);
+
+  std::vector<uint8_t> code = finish(as);
+  ASSERT_EQ(code.size(), 8 + (40 << 10));
+  // tbnz x3, #40, +8; b target
+  uint32_t skip = word(code, 0);
+  EXPECT_EQ(skip & 0x7F00001F, 0x37000003u);
+  EXPECT_EQ(skip >> 31, 1u);
+  EXPECT_EQ((skip >> 19) & 0x1F, 40u - 32);
+  EXPECT_EQ(imm14_offset(skip), 8);
+  ASSERT_TRUE(is_b(word(code, 4)));
+  EXPECT_EQ(4 + b_offset(word(code, 4)), 8 + (40 << 10));
+}
+
+TEST(Arm64Assembler, BCondAndCbzPastRangeBackwards) {
+  Arm64Assembler as;
+  Label target = as.new_label();
+  as.bind(target);
+  pad(as, 2 << 20);
+  as.b_cond(Cond::EQ, target);
+  as.cbz(7, target);
+
+  std::vector<uint8_t> code = finish(as);
+  size_t pos = 2 << 20;
+  ASSERT_EQ(code.size(), pos + 16);
+  // b.ne +8; b target
+  EXPECT_EQ(word(code, pos) & 0xFF00001F, 0x54000001u);
+  EXPECT_EQ(imm19_offset(word(code, pos)), 8);
+  ASSERT_TRUE(is_b(word(code, pos + 4)));
+  EXPECT_EQ(pos + 4 + b_offset(word(code, pos + 4)), 0u);
+  // cbnz x7, +8; b target
+  EXPECT_EQ(word(code, pos + 8) & 0xFF00001F, 0xB5000007u);
+  EXPECT_EQ(imm19_offset(word(code, pos + 8)), 8);
+  ASSERT_TRUE(is_b(word(code, pos + 12)));
+  EXPECT_EQ(pos + 12 + b_offset(word(code, pos + 12)), 0u);
+}
+
+TEST(Arm64Assembler, LiteralPastRangeUsesAdrp) {
+  Arm64Assembler as;
+  as.ldr_literal(5, as.literal(0x1122334455667788));
+  pad(as, (1 << 20) + 12);
+
+  std::vector<uint8_t> code = finish(as);
+  size_t code_end = 8 + (1 << 20) + 12;
+  size_t pool = (code_end + 7) & ~size_t{7};
+  ASSERT_EQ(code.size(), pool + 8);
+  for (size_t pos = code_end; pos < pool; ++pos) {
+    EXPECT_EQ(code[pos], 0);
+  }
+  uint64_t value;
+  std::memcpy(&value, code.data() + pool, sizeof(value));
+  EXPECT_EQ(value, 0x1122334455667788u);
+
+  // adrp x5, pool page; ldr x5, [x5, #lo12]
+  uint32_t adrp = word(code, 0);
+  ASSERT_TRUE(is_adrp(adrp));
+  EXPECT_EQ(adrp & 0x1F, 5u);
+  EXPECT_EQ(adrp_pages(adrp), static_cast<int64_t>(pool >> 12));
+  uint32_t ldr = word(code, 4);
+  EXPECT_EQ(ldr & 0xFFC003FF, 0xF94000A5u);
+  EXPECT_EQ(((ldr >> 10) & 0xFFF) * 8, pool & 0xFFF);
+}
+
+TEST(Arm64Assembler, AdrpAccountsForBase) {
+  Arm64Assembler as;
+  Label target = as.new_label();
+  as.adr(9, target);
+  pad(as, 3 << 20);
+  as.bind(target);
+
+  // placed 0xFF0 into a page, the target lands one page further on
+  uint64_t base = 0x40000FF0;
+  std::vector<uint8_t> code = finish(as, base);
+  uint64_t to = base + 8 + (3 << 20);
+  uint32_t adrp = word(code, 0);
+  ASSERT_TRUE(is_adrp(adrp));
+  EXPECT_EQ(adrp_pages(adrp),
+            static_cast<int64_t>(to >> 12) -
+                static_cast<int64_t>(base >> 12));
+  // add x9, x9, #lo12
+  uint32_t add = word(code, 4);
+  EXPECT_EQ(add & 0xFFC003FF, 0x91000129u);
+  EXPECT_EQ((add >> 10) & 0xFFF, to & 0xFFF);
+}
+
+TEST(Arm64Assembler, PromotionPushesNeighbourOutOfRange) {
+  // The TBZ reaches its target exactly, until the B.cond between them
+  // is promoted and grows the distance by 4.
+  Arm64Assembler as;
+  Label near = as.new_label();
+  Label far = as.new_label();
+  as.tbz(1, 0, near);
+  as.b_cond(Cond::NE, far);
+  pad(as, 32764 - 8);
+  as.bind(near);
+  pad(as, 1 << 20);
+  as.bind(far);
+
+  std::vector<uint8_t> code = finish(as);
+  size_t near_pos = 32764 + 8;
+  size_t far_pos = near_pos + (1 << 20);
+  ASSERT_EQ(code.size(), far_pos);
+
+  // tbnz w1, #0, +8; b near
+  EXPECT_EQ(word(code, 0) & 0xFF00001F, 0x37000001u);
+  EXPECT_EQ(imm14_offset(word(code, 0)), 8);
+  ASSERT_TRUE(is_b(word(code, 4)));
+  EXPECT_EQ(4 + b_offset(word(code, 4)), near_pos);
+  // b.eq +8; b far
+  EXPECT_EQ(word(code, 8) & 0xFF00001F, 0x54000000u);
+  EXPECT_EQ(imm19_offset(word(code, 8)), 8);
+  ASSERT_TRUE(is_b(word(code, 12)));
+  EXPECT_EQ(12 + b_offset(word(code, 12)), far_pos);
+}
+
+TEST(Arm64Assembler, LiteralsAreSharedAndAligned) {
+  Arm64Assembler as;
+  as.ldr_literal(1, as.literal(42));
+  as.ldr_literal(2, as.literal(7));
+  as.ldr_literal(3, as.literal(42));
+
+  std::vector<uint8_t> code = finish(as);
+  // three instructions, padded to 16, then two literals
+  ASSERT_EQ(code.size(), 16 + 16);
+  EXPECT_EQ(word(code, 12), 0u);
+  EXPECT_EQ(imm19_offset(word(code, 0)), 16);
+  EXPECT_EQ(imm19_offset(word(code, 4)), 24 - 4);
+  EXPECT_EQ(imm19_offset(word(code, 8)), 16 - 8);
+}
+
+TEST(Arm64Assembler, UnboundLabelFails) {
+  Arm64Assembler as;
+  as.b(as.new_label());
+
+  std::vector<uint8_t> code;
+  OutputIt out = std::back_inserter(code);
+  EXPECT_EQ(as.finish(0, out).code(),
+            absl::StatusCode::kFailedPrecondition);
+}
+
+} // namespace
@@ -0,0 +1,326 @@
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "qream/backend.h"
+#include "qream/ir.h"
+#include "qream/memory.h"
+#include "qream/runtime.h"
+#include "test_helpers.h"
+
+namespace {
+
+using enum IROp;
+
+class BackendTest : public DispatcherTest {
+ protected:
+  void SetUp() override {
+    DispatcherTest::SetUp();
+    start();
+  }
+};
+
+TEST_F(BackendTest, CallEndingRegionReturnsToReturnAddress) {
+  add_block(0x100, {
+                       op(0x100, Add, {reg(3), reg(1), reg(2)}, 3),
+                       op(0x101, Ldr, {Imm64{0x104}, reg(6)}, 2),
+                       op(0x102, Call, {Imm64{0x200}, Imm64{0x104}}, 2),
+                   });
+  add_block(0x200, {
+                       op(0x200, Xor, {reg(4), reg(1), reg(2)}, 3),
+                       op(0x201, Ret, {reg(6)}, 1),
+                   });
+  add_block(0x104, {op(0x104, Halt, {}, 0)});
+
+  // the second round runs with every jump chained
+  for (int round = 0; round < 2; ++round) {
+    VCpuState state;
+    state.pc = 0x100;
+    state.regs[1] = 10;
+    state.regs[2] = 3;
+
+    absl::StatusOr<ExitReason> reason = dispatcher_->run(state);
+    ASSERT_TRUE(reason.ok()) << reason.status();
+    EXPECT_EQ(*reason, ExitReason::Halt);
+    EXPECT_EQ(state.pc, 0x104);
+    EXPECT_EQ(state.regs[3], 13);
+    EXPECT_EQ(state.regs[4], 10 ^ 3);
+    EXPECT_EQ(state.ras.top, 0);
+  }
+}
+
+TEST_F(BackendTest, CallThroughRegisterEndingRegion) {
+  add_block(0x100, {
+                       op(0x100, Ldr, {Imm64{0x200}, reg(5)}, 2),
+                       op(0x101, Ldr, {Imm64{0x104}, reg(6)}, 2),
+                       op(0x102, Call, {reg(5), Imm64{0x104}}, 2),
+                   });
+  add_block(0x200, {
+                       op(0x200, Add, {reg(3), reg(1), reg(2)}, 3),
+                       op(0x201, Ret, {reg(6)}, 1),
+                   });
+  add_block(0x104, {op(0x104, Halt, {}, 0)});
+
+  VCpuState state;
+  state.pc = 0x100;
+  state.regs[1] = 4;
+  state.regs[2] = 5;
+
+  absl::StatusOr<ExitReason> reason = dispatcher_->run(state);
+  ASSERT_TRUE(reason.ok()) << reason.status();
+  EXPECT_EQ(*reason, ExitReason::Halt);
+  EXPECT_EQ(state.pc, 0x104);
+  EXPECT_EQ(state.regs[3], 9);
+}
+
+TEST_F(BackendTest, BranchToEmptySlotTagMisses) {
+  // ~0 is what empty branch cache slots used to be tagged with
+  constexpr const uint64_t kTarget = ~uint64_t{0};
+  add_block(0x100, {
+                       op(0x100, Ldr, {Imm64{kTarget}, reg(5)}, 2),
+                       op(0x101, Jump, {reg(5)}, 1),
+                   });
+  add_block(0x200, {
+                       op(0x200, Ldr, {Imm64{kTarget}, reg(5)}, 2),
+                       op(0x201, Ret, {reg(5)}, 1),
+                   });
+
+  for (uint64_t pc : {0x100, 0x200}) {
+    VCpuState state;
+    state.pc = pc;
+    absl::StatusOr<ExitReason> reason = dispatcher_->run(state);
+    EXPECT_EQ(reason.status().code(), absl::StatusCode::kNotFound);
+    EXPECT_EQ(state.pc, kTarget);
+  }
+}
+
+TEST_F(BackendTest, FlatAddressingForms) {
+  absl::StatusOr<GuestMemory> memory = GuestMemory::flat();
+  ASSERT_TRUE(memory.ok()) << memory.status();
+  ASSERT_TRUE(memory->mapInto(0x10000, 4096, SegmentFlags{}).ok());
+
+  add_block(0x100,
+            {
+                // [index + offset]
+                op(0x100, Str,
+                   {MemoryAddressing{std::nullopt, reg(2), 0x10000},
+                    reg(1)},
+                   2),
+                // [base + index + offset]
+                op(0x101, Ldr,
+                   {MemoryAddressing{reg(3), reg(2), 0x10}, reg(4)}, 2),
+                // [offset]
+                op(0x102, Ldr,
+                   {MemoryAddressing{std::nullopt, std::nullopt, 0x10010},
+                    reg(5)},
+                   2),
+                op(0x103, Halt, {}, 0),
+            },
+            MemoryMode::Flat);
+
+  VCpuState state;
+  state.pc = 0x100;
+  state.mem_base = memory->window_base;
+  state.regs[1] = 0xC0FFEE;
+  state.regs[2] = 0x10;
+  state.regs[3] = 0xFFF0; // 0xFFF0 + 0x10 + 0x10
+
+  absl::StatusOr<ExitReason> reason = dispatcher_->run(state);
+  ASSERT_TRUE(reason.ok()) << reason.status();
+  EXPECT_EQ(*reason, ExitReason::Halt);
+
+  uint64_t stored;
+  std::memcpy(&stored, memory->window_base + 0x10010, sizeof(stored));
+  EXPECT_EQ(stored, 0xC0FFEE);
+  EXPECT_EQ(state.regs[4], 0xC0FFEE);
+  EXPECT_EQ(state.regs[5], 0xC0FFEE);
+}
+
+TEST_F(BackendTest, SegmentedStoreForms) {
+  std::array<uint64_t, 4> slots{};
+  uint64_t host = reinterpret_cast<uint64_t>(slots.data());
+
+  add_block(0x100,
+            {
+                // [offset] with a full 64-bit host address
+                op(0x100, Str,
+                   {MemoryAddressing{std::nullopt, std::nullopt, host},
+                    reg(1)},
+                   2),
+                // [base + index]
+                op(0x101, Str,
+                   {MemoryAddressing{reg(3), reg(4), 0}, reg(1)}, 2),
+                // [base + offset] with an offset past 32 bits
+                op(0x102, Str,
+                   {MemoryAddressing{reg(5), std::nullopt,
+                                     uint64_t{1} << 32},
+                    reg(1)},
+                   2),
+                op(0x103, Halt, {}, 0),
+            });
+
+  VCpuState state;
+  state.pc = 0x100;
+  state.regs[1] = 7;
+  state.regs[3] = host;
+  state.regs[4] = 8;
+  state.regs[5] = host + 16 - (uint64_t{1} << 32);
+
+  absl::StatusOr<ExitReason> reason = dispatcher_->run(state);
+  ASSERT_TRUE(reason.ok()) << reason.status();
+  EXPECT_EQ(*reason, ExitReason::Halt);
+  EXPECT_EQ(slots, (std::array<uint64_t, 4>{7, 7, 7, 0}));
+}
+
+TEST(Backend, X86_64TrampolineAlignsStack) {
+  if (host_backend() != Backend::X86_64) GTEST_SKIP();
+
+  std::vector<uint8_t> trampoline = emit_trampoline(Backend::X86_64);
+  absl::StatusOr<void *> entry = map_executable(trampoline);
+  ASSERT_TRUE(entry.ok()) << entry.status();
+  // regs[0] = rsp & 15, as seen on entry to generated code
+  std::vector<uint8_t> block = {
+      0x48, 0x89, 0xE0,       // mov rax, rsp
+      0x48, 0x83, 0xE0, 0x0F, // and rax, 15
+      0x49, 0x89, 0x07,       // mov [r15], rax
+      0xC3,                   // ret
+  };
+  absl::StatusOr<void *> code = map_executable(block);
+  ASSERT_TRUE(code.ok()) << code.status();
+
+  VCpuState state;
+  state.exit_reason = ExitReason::Halt;
+  state.regs[0] = ~uint64_t{0};
+  ExitReason reason = reinterpret_cast<EntryFn>(*entry)(&state, *code);
+  EXPECT_EQ(reason, ExitReason::Halt);
+  // like any function entered by a CALL from an aligned stack
+  EXPECT_EQ(state.regs[0], 8);
+
+  unmap_executable(*code, block.size());
+  unmap_executable(*entry, trampoline.size());
+}
+
+std::vector<uint32_t> words(const std::vector<uint8_t> &code) {
+  std::vector<uint32_t> result(code.size() / 4);
+  std::memcpy(result.data(), code.data(), result.size() * 4);
+  return result;
+}
+
+TEST(Backend, Arm64FlatAddressWithoutBase) {
+  std::vector<Operation> ops = {
+      op(0, Str, {MemoryAddressing{std::nullopt, reg(2), 0x10000}, reg(1)},
+         2),
+  };
+  absl::StatusOr<std::vector<uint8_t>> code =
+      transpile(Backend::Arm64, ops, MemoryMode::Flat);
+  ASSERT_TRUE(code.ok()) << code.status();
+  EXPECT_EQ(words(*code), (std::vector<uint32_t>{
+                              0xD2800010, // mov x16, #0
+                              0xF2A00030, // movk x16, #1, lsl #16
+                              0x0B020210, // add w16, w16, w2
+                              0xF8304B61, // str x1, [x27, w16, uxtw]
+                          }));
+}
+
+TEST(Backend, Arm64SegmentedStoreForms) {
+  auto store = [](MemoryAddressing mem) {
+    std::vector<Operation> ops = {op(0, Str, {mem, reg(1)}, 2)};
+    absl::StatusOr<std::vector<uint8_t>> code =
+        transpile(Backend::Arm64, ops);
+    EXPECT_TRUE(code.ok()) << code.status();
+    return code.ok() ? words(*code) : std::vector<uint32_t>{};
+  };
+
+  EXPECT_EQ(store(MemoryAddressing{reg(3), std::nullopt, 16}),
+            (std::vector<uint32_t>{0xF9000861})); // str x1, [x3, #16]
+  EXPECT_EQ(store(MemoryAddressing{reg(3), reg(4), 0}),
+            (std::vector<uint32_t>{
+                0xD2800010, // mov x16, #0
+                0x8B030210, // add x16, x16, x3
+                0x8B040210, // add x16, x16, x4
+                0xF9000201, // str x1, [x16]
+            }));
+  EXPECT_EQ(store(MemoryAddressing{std::nullopt, std::nullopt, 0x1234}),
+            (std::vector<uint32_t>{
+                0xD2824690, // mov x16, #0x1234
+                0xF9000201, // str x1, [x16]
+            }));
+}
+
+TEST(Backend, Arm64SegmentedLoadForms) {
+  auto load = [](MemoryAddressing mem) {
+    std::vector<Operation> ops = {op(0, Ldr, {mem, reg(1)}, 2)};
+    absl::StatusOr<std::vector<uint8_t>> code =
+        transpile(Backend::Arm64, ops);
+    EXPECT_TRUE(code.ok()) << code.status();
+    return code.ok() ? words(*code) : std::vector<uint32_t>{};
+  };
+
+  EXPECT_EQ(load(MemoryAddressing{reg(3), std::nullopt, 16}),
+            (std::vector<uint32_t>{0xF9400861})); // ldr x1, [x3, #16]
+  EXPECT_EQ(load(MemoryAddressing{reg(3), reg(4), 0}),
+            (std::vector<uint32_t>{
+                0xD2800010, // mov x16, #0
+                0x8B030210, // add x16, x16, x3
+                0x8B040210, // add x16, x16, x4
+                0xF9400201, // ldr x1, [x16]
+            }));
+}
+
+TEST(Backend, UnmatchedSignatureIsExplained) {
+  std::vector<Operation> ops = {
+      op(0, Jump, {MemoryAddressing{reg(1), std::nullopt, 0}}, 1),
+  };
+  for (Backend backend : {Backend::Arm64, Backend::X86_64}) {
+    absl::StatusOr<std::vector<uint8_t>> code = transpile(backend, ops);
+    EXPECT_EQ(code.status().code(), absl::StatusCode::kInvalidArgument);
+    EXPECT_NE(code.status().message(), "");
+  }
+}
+
+TEST(Backend, RejectsReservedArm64Registers) {
+  // x16/x17 are scratch, x27 holds the window base and x28 the state
+  for (uint8_t enc : {16, 17, 27, 28, 29, 30, 31}) {
+    std::vector<std::vector<Operation>> regions = {
+        {op(0, Add, {reg(1), reg(enc), reg(2)}, 3)},
+        {op(0, Ldr, {Imm64{1}, reg(enc)}, 2)},
+        {op(0, Jump, {reg(enc)}, 1)},
+        {op(0, Str, {MemoryAddressing{reg(enc), std::nullopt, 0}, reg(1)},
+            2)},
+    };
+    for (const std::vector<Operation> &ops : regions) {
+      absl::StatusOr<std::vector<uint8_t>> code =
+          transpile(Backend::Arm64, ops, MemoryMode::Flat);
+      EXPECT_EQ(code.status().code(), absl::StatusCode::kInvalidArgument)
+          << "x" << int{enc};
+    }
+  }
+
+  std::vector<Operation> ok = {op(0, Add, {reg(26), reg(18), reg(15)}, 3)};
+  EXPECT_TRUE(transpile(Backend::Arm64, ok).ok());
+}
+
+TEST(Backend, RejectsRegistersOutsideX86_64RegisterFile) {
+  for (uint8_t enc : {32, 33, 255}) {
+    std::vector<std::vector<Operation>> regions = {
+        {op(0, Add, {reg(enc), reg(1), reg(2)}, 3)},
+        {op(0, Ret, {reg(enc)}, 1)},
+        {op(0, Ldr, {MemoryAddressing{reg(1), reg(enc), 0}, reg(2)}, 2)},
+    };
+    for (const std::vector<Operation> &ops : regions) {
+      absl::StatusOr<std::vector<uint8_t>> code =
+          transpile(Backend::X86_64, ops, MemoryMode::Flat);
+      EXPECT_EQ(code.status().code(), absl::StatusCode::kInvalidArgument)
+          << "reg " << int{enc};
+    }
+  }
+
+  std::vector<Operation> ok = {op(0, Add, {reg(31), reg(16), reg(28)}, 3)};
+  EXPECT_TRUE(transpile(Backend::X86_64, ok).ok());
+}
+
+} // namespace
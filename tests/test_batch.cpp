@@ -0,0 +1,203 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <optional>
+#include <span>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "qream/backend.h"
+#include "qream/batch.h"
+#include "qream/ir.h"
+#include "test_helpers.h"
+
+// Every allocation in the test binary, workers included.
+static std::atomic<size_t> allocations = 0;
+
+void *operator new(size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void *ptr = std::malloc(size ? size : 1)) return ptr;
+  throw std::bad_alloc();
+}
+
+void *operator new(size_t size, std::align_val_t align) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  size_t alignment = static_cast<size_t>(align);
+  size = (std::max<size_t>(size, 1) + alignment - 1) & ~(alignment - 1);
+  if (void *ptr = std::aligned_alloc(alignment, size)) return ptr;
+  throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { std::free(ptr); }
+void operator delete(void *ptr, std::align_val_t) noexcept {
+  std::free(ptr);
+}
+void operator delete(void *ptr, size_t, std::align_val_t) noexcept {
+  std::free(ptr);
+}
+
+namespace {
+
+using enum IROp;
+
+// Regions of varying length; every 7th names a register no backend has,
+// so it fails to translate partway through.
+bool made_to_fail(size_t region) { return region % 7 == 3; }
+
+std::vector<std::vector<Operation>> make_regions(size_t count) {
+  std::vector<std::vector<Operation>> regions(count);
+  for (size_t i = 0; i < count; ++i) {
+    uint64_t addr = 0x1000 + i * 0x100;
+    std::vector<Operation> &ops = regions[i];
+    for (size_t j = 0; j < i % 5; ++j) {
+      ops.push_back(op(addr + j, Add, {reg(3), reg(3), reg(j + 1)}, 3));
+    }
+    ops.push_back(op(addr + 8, Ldr,
+                     {MemoryAddressing{reg(1), reg(2), i * 8}, reg(4)},
+                     2));
+    if (made_to_fail(i)) {
+      ops.push_back(op(addr + 9, Add, {reg(3), reg(255), reg(1)}, 3));
+    }
+    ops.push_back(op(addr + 10, Jump, {Imm64{addr + 0x100}}, 1));
+  }
+  return regions;
+}
+
+std::vector<std::span<const Operation>> spans(
+    const std::vector<std::vector<Operation>> &regions) {
+  return {regions.begin(), regions.end()};
+}
+
+// Every region's code must match a lone `transpile` of it, byte for byte.
+void expect_matches_transpile(
+    Backend backend, MemoryMode mem_mode,
+    const std::vector<std::vector<Operation>> &regions,
+    const std::vector<RegionResult> &results, std::span<const uint8_t> code,
+    size_t base = 0) {
+  ASSERT_EQ(results.size(), regions.size());
+  size_t offset = base;
+  for (size_t i = 0; i < regions.size(); ++i) {
+    const RegionResult &result = results[i];
+    absl::StatusOr<std::vector<uint8_t>> expected =
+        transpile(backend, regions[i], mem_mode);
+    EXPECT_EQ(result.status.code(), expected.status().code())
+        << "region " << i;
+    EXPECT_EQ(result.offset, offset) << "region " << i;
+    if (!expected.ok()) {
+      EXPECT_EQ(result.size, 0) << "region " << i;
+      continue;
+    }
+    ASSERT_EQ(result.size, expected->size()) << "region " << i;
+    ASSERT_LE(result.offset + result.size, code.size());
+    EXPECT_TRUE(std::equal(expected->begin(), expected->end(),
+                           code.begin() + result.offset))
+        << "region " << i;
+    offset += result.size;
+  }
+  EXPECT_EQ(offset, code.size());
+}
+
+TEST(TranslationPool, MatchesSingleTranspile) {
+  std::vector<std::vector<Operation>> regions = make_regions(1000);
+  std::vector<std::span<const Operation>> views = spans(regions);
+
+  TranslationPool pool(4);
+  for (Backend backend : {Backend::X86_64, Backend::Arm64}) {
+    for (MemoryMode mem_mode : {MemoryMode::Segmented, MemoryMode::Flat}) {
+      std::vector<uint8_t> out = {0xAA, 0xBB, 0xCC};
+      std::vector<RegionResult> results =
+          pool.translate(backend, views, out, mem_mode);
+      EXPECT_EQ(out[0], 0xAA);
+      expect_matches_transpile(backend, mem_mode, regions, results, out,
+                               3);
+
+      // every backend and mode lowers all of it, so only the regions
+      // made to fail may fail
+      for (size_t i = 0; i < results.size(); ++i) {
+        EXPECT_EQ(results[i].status.ok(), !made_to_fail(i))
+            << "backend " << static_cast<int>(backend) << ", mode "
+            << static_cast<int>(mem_mode) << ", region " << i;
+      }
+    }
+  }
+}
+
+TEST(TranslationPool, PoolBufferIsReused) {
+  TranslationPool pool(3);
+  for (size_t count : {200, 1, 0, 130}) {
+    std::vector<std::vector<Operation>> regions = make_regions(count);
+    std::vector<RegionResult> results =
+        pool.translate(Backend::X86_64, spans(regions));
+    expect_matches_transpile(Backend::X86_64, MemoryMode::Segmented,
+                             regions, results, pool.code());
+  }
+}
+
+TEST(TranslationPool, FailedRegionsLeaveNoCode) {
+  std::vector<std::vector<Operation>> regions = {
+      {op(0, Add, {reg(3), reg(255), reg(1)}, 3)},
+      {op(1, Add, {reg(1), reg(2), reg(3)}, 3),
+       op(2, Ldr, {Imm64{1}, reg(255)}, 2)},
+  };
+
+  TranslationPool pool(2);
+  std::vector<uint8_t> out;
+  std::vector<RegionResult> results =
+      pool.translate(Backend::Arm64, spans(regions), out);
+  ASSERT_EQ(results.size(), 2);
+  for (const RegionResult &result : results) {
+    EXPECT_EQ(result.status.code(), absl::StatusCode::kInvalidArgument);
+    EXPECT_EQ(result.offset, 0);
+    EXPECT_EQ(result.size, 0);
+  }
+  EXPECT_TRUE(out.empty());
+}
+
+TEST(TranslationPool, AllocationsDontScaleWithRegions) {
+  // every kind of op each backend emits, none failing
+  std::vector<std::vector<Operation>> regions(10000);
+  for (size_t i = 0; i < regions.size(); ++i) {
+    uint64_t addr = 0x1000 + i * 0x100;
+    regions[i] = {
+        op(addr, Add, {reg(3), reg(3), reg(2)}, 3),
+        op(addr + 1, Ldr, {Imm64{addr}, reg(5)}, 2),
+        op(addr + 2, Str, {MemoryAddressing{reg(1), reg(2), 8}, reg(4)},
+           2),
+        op(addr + 3, Ldr, {MemoryAddressing{reg(1), std::nullopt, 16},
+                           reg(4)},
+           2),
+        op(addr + 4, Call, {reg(5), Imm64{addr + 6}}, 2),
+        op(addr + 5, Call, {Imm64{addr}, Imm64{addr + 6}}, 2),
+        op(addr + 6, Ret, {reg(6)}, 1),
+        op(addr + 7, Jump, {reg(5)}, 1),
+        op(addr + 8, Jump, {Imm64{addr + 0x100}}, 1),
+    };
+  }
+  std::vector<std::span<const Operation>> views = spans(regions);
+
+  TranslationPool pool(4);
+  for (Backend backend : {Backend::X86_64, Backend::Arm64}) {
+    for (MemoryMode mem_mode : {MemoryMode::Segmented, MemoryMode::Flat}) {
+      // warm up the pool's and the workers' buffers
+      pool.translate(backend, views, mem_mode);
+
+      size_t before = allocations.load();
+      std::vector<RegionResult> results =
+          pool.translate(backend, views, mem_mode);
+      size_t count = allocations.load() - before;
+
+      // the placement and result vectors, whatever the region count
+      EXPECT_LE(count, 4) << "backend " << static_cast<int>(backend)
+                          << ", mode " << static_cast<int>(mem_mode);
+      for (const RegionResult &result : results) {
+        ASSERT_TRUE(result.status.ok()) << result.status;
+      }
+    }
+  }
+}
+
+} // namespace
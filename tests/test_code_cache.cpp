@@ -0,0 +1,329 @@
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "qream/backend.h"
+#include "qream/code_cache.h"
+#include "qream/ir.h"
+#include "qream/runtime.h"
+#include "test_helpers.h"
+
+namespace {
+
+using enum IROp;
+
+// r3 += r2, then a direct jump to `next`.
+std::vector<Operation> step(uint64_t addr, uint64_t next) {
+  return {
+      op(addr, Add, {reg(3), reg(3), reg(2)}, 3),
+      op(addr + 1, Jump, {Imm64{next}}, 1),
+  };
+}
+
+std::vector<Operation> halt(uint64_t addr) {
+  return {op(addr, Halt, {}, 0)};
+}
+
+class CodeCacheTest : public DispatcherTest {
+ protected:
+  void start(CodeCacheOptions options = {}) {
+    real_entry_ = trampoline();
+    DispatcherTest::start(options, &counting_entry);
+  }
+
+  // Counts dispatcher entries into generated code, so a run that stays
+  // chained from start to finish shows up as a single entry.
+  static ExitReason counting_entry(VCpuState *state, const void *code) {
+    ++entries_;
+    return real_entry_(state, code);
+  }
+
+  // Runs from `pc` with r3 = 0, r2 = 1 and expects a Halt at `halt_pc`;
+  // returns r3, i.e. how many steps ran.
+  uint64_t run_to_halt(VCpuState &state, uint64_t pc, uint64_t halt_pc) {
+    state.pc = pc;
+    state.regs[2] = 1;
+    state.regs[3] = 0;
+    absl::StatusOr<ExitReason> reason = dispatcher_->run(state);
+    EXPECT_TRUE(reason.ok()) << reason.status();
+    if (reason.ok()) {
+      EXPECT_EQ(*reason, ExitReason::Halt);
+    }
+    EXPECT_EQ(state.pc, halt_pc);
+    return state.regs[3];
+  }
+
+  static inline EntryFn real_entry_ = nullptr;
+  static inline int entries_ = 0;
+};
+
+TEST_F(CodeCacheTest, MissDoesNotLeaveLinkSitePending) {
+  start();
+  add_block(0x1000, step(0x1000, 0x1010));
+  add_block(0x1010, step(0x1010, 0x1020));
+
+  VCpuState state;
+  state.pc = 0x1000;
+  absl::StatusOr<ExitReason> reason = dispatcher_->run(state);
+  EXPECT_EQ(reason.status().code(), absl::StatusCode::kNotFound);
+  EXPECT_EQ(state.pc, 0x1020);
+  EXPECT_EQ(state.link_site, 0);
+
+  // Resuming somewhere else must not chain 0x1010's exit to it.
+  add_block(0x1020, halt(0x1020));
+  add_block(0x1030, halt(0x1030));
+  run_to_halt(state, 0x1030, 0x1030);
+
+  for (int round = 0; round < 2; ++round) {
+    EXPECT_EQ(run_to_halt(state, 0x1000, 0x1020), 2);
+  }
+}
+
+// Permission strings ("r-xp", ...) of the mappings overlapping
+// [begin, end).
+std::vector<std::string> protections(const void *begin, const void *end) {
+  uint64_t lo = reinterpret_cast<uint64_t>(begin);
+  uint64_t hi = reinterpret_cast<uint64_t>(end);
+  std::vector<std::string> result;
+  std::ifstream maps("/proc/self/maps");
+  std::string line;
+  while (std::getline(maps, line)) {
+    uint64_t first, last;
+    char perms[5] = {};
+    if (std::sscanf(line.c_str(), "%lx-%lx %4s", &first, &last, perms) ==
+            3 &&
+        first < hi && last > lo) {
+      result.push_back(perms);
+    }
+  }
+  return result;
+}
+
+TEST_F(CodeCacheTest, CodeIsNeverWritableAndExecutable) {
+  constexpr const size_t kBudget = 64 << 10;
+  start({.budget = kBudget, .nursery_size = 8 << 10, .promote_after = 1});
+  add_block(0x1000, step(0x1000, 0x1010));
+  add_block(0x1010, halt(0x1010));
+
+  VCpuState state;
+  run_to_halt(state, 0x1000, 0x1010);
+  run_to_halt(state, 0x1000, 0x1010); // linked by now
+  const uint8_t *mem = dispatcher_->cache().lookup(0x1000);
+
+  // flushes, promotions and ring wraps unseal pages all over the cache
+  for (uint64_t i = 0; i < 1000; ++i) {
+    uint64_t guest_addr = 0x2000 + i * 0x10;
+    add_block(guest_addr, step(guest_addr, guest_addr + 8));
+    add_block(guest_addr + 8, halt(guest_addr + 8));
+    run_to_halt(state, guest_addr, guest_addr + 8);
+  }
+  for (const std::string &perms : protections(mem, mem + kBudget)) {
+    EXPECT_EQ(perms, "r-xp");
+  }
+}
+
+TEST_F(CodeCacheTest, ChainedBlocksSurviveNurseryFlush) {
+  start({.budget = 8192, .nursery_size = 1024, .promote_after = 2});
+  add_block(0x1000, {
+                        op(0x1000, Ldr, {Imm64{0x1010}, reg(5)}, 2),
+                        op(0x1001, Jump, {reg(5)}, 1),
+                    });
+  add_block(0x1010, step(0x1010, 0x1020));
+  add_block(0x1020, halt(0x1020));
+
+  VCpuState state;
+  for (int round = 0; round < 2; ++round) {
+    EXPECT_EQ(run_to_halt(state, 0x1000, 0x1020), 1);
+  }
+
+  // fill the nursery with blocks that never run until it flushes
+  CodeCache &cache = dispatcher_->cache();
+  const uint8_t *nursery_host = cache.lookup(0x1010);
+  uint64_t filler = 0x9000;
+  while (cache.lookup(0x1010) == nursery_host && filler < 0xA000) {
+    add_block(filler, halt(filler));
+    filler += 0x10;
+  }
+  ASSERT_NE(cache.lookup(0x1010), nursery_host);
+  EXPECT_EQ(cache.lookup(0x9000), nullptr);
+
+  // the branch cache still pointed into the nursery, so the first run
+  // has to look the indirect target up again
+  EXPECT_EQ(run_to_halt(state, 0x1000, 0x1020), 1);
+  entries_ = 0;
+  EXPECT_EQ(run_to_halt(state, 0x1000, 0x1020), 1);
+  EXPECT_EQ(entries_, 1);
+}
+
+TEST_F(CodeCacheTest, ReinsertedBlocksAreRelinked) {
+  start();
+  add_block(0x1000, step(0x1000, 0x1010));
+  add_block(0x1010, halt(0x1010));
+
+  VCpuState state;
+  run_to_halt(state, 0x1000, 0x1010);
+  entries_ = 0;
+  EXPECT_EQ(run_to_halt(state, 0x1000, 0x1010), 1);
+  EXPECT_EQ(entries_, 1);
+
+  // replacing the target unlinks 0x1000 from the old code
+  add_block(0x1010, step(0x1010, 0x1020));
+  add_block(0x1020, halt(0x1020));
+  EXPECT_EQ(run_to_halt(state, 0x1000, 0x1020), 2);
+  entries_ = 0;
+  EXPECT_EQ(run_to_halt(state, 0x1000, 0x1020), 2);
+  EXPECT_EQ(entries_, 1);
+
+  // and replacing the source drops its old links into the target
+  add_block(0x1000, {
+                        op(0x1000, Add, {reg(3), reg(3), reg(2)}, 3),
+                        op(0x1001, Add, {reg(3), reg(3), reg(2)}, 3),
+                        op(0x1002, Jump, {Imm64{0x1010}}, 1),
+                    });
+  EXPECT_EQ(run_to_halt(state, 0x1000, 0x1020), 3);
+  add_block(0x1010, halt(0x1010));
+  entries_ = 0;
+  EXPECT_EQ(run_to_halt(state, 0x1000, 0x1010), 2);
+  EXPECT_EQ(entries_, 2);
+  entries_ = 0;
+  EXPECT_EQ(run_to_halt(state, 0x1000, 0x1010), 2);
+  EXPECT_EQ(entries_, 1);
+}
+
+TEST_F(CodeCacheTest, OldRingWrapKeepsRecentBlocksRunning) {
+  start({.budget = 2048, .nursery_size = 512, .promote_after = 1});
+
+  // every block runs once, so every flush promotes the whole nursery
+  VCpuState state;
+  constexpr const uint64_t kBlocks = 200;
+  for (uint64_t i = 0; i < kBlocks; ++i) {
+    uint64_t guest_addr = 0x1000 + i * 0x10;
+    add_block(guest_addr, halt(guest_addr));
+    run_to_halt(state, guest_addr, guest_addr);
+  }
+
+  CodeCache &cache = dispatcher_->cache();
+  EXPECT_LT(cache.size(), kBlocks);
+  // evicted oldest first: what is left is a run of the latest blocks
+  uint64_t first_kept = kBlocks - cache.size();
+  for (uint64_t i = 0; i < kBlocks; ++i) {
+    EXPECT_EQ(cache.lookup(0x1000 + i * 0x10) != nullptr, i >= first_kept)
+        << "block " << i;
+  }
+
+  state.pc = 0x1000;
+  EXPECT_EQ(dispatcher_->run(state).status().code(),
+            absl::StatusCode::kNotFound);
+  add_block(0x1000, halt(0x1000));
+  run_to_halt(state, 0x1000, 0x1000);
+}
+
+// Fixed-size blocks of filler, inserted straight into a cache with room
+// for 4 of them in the nursery and 12 in the old ring.
+class CodeCacheLayoutTest : public ::testing::Test {
+ protected:
+  static constexpr const size_t kBlockSize = 64;
+
+  void SetUp() override {
+    absl::StatusOr<CodeCache> cache = CodeCache::create(
+        host_backend(), {.budget = 16 * kBlockSize,
+                         .nursery_size = 4 * kBlockSize,
+                         .promote_after = 1});
+    ASSERT_TRUE(cache.ok()) << cache.status();
+    cache_.emplace(std::move(*cache));
+  }
+
+  const uint8_t *insert(uint64_t guest_addr) {
+    std::vector<uint8_t> code(kBlockSize, 0);
+    absl::StatusOr<const uint8_t *> host = cache_->insert(guest_addr, code);
+    EXPECT_TRUE(host.ok()) << host.status();
+    return host.ok() ? *host : nullptr;
+  }
+
+  std::optional<CodeCache> cache_;
+};
+
+void expect_range(const HostRange &range, const uint8_t *begin,
+                  size_t size) {
+  EXPECT_EQ(range.begin, begin);
+  EXPECT_EQ(range.end, begin + size);
+}
+
+TEST_F(CodeCacheLayoutTest, FlushPromotesLiveBlocksAndReportsNursery) {
+  const uint8_t *mem = insert(0xA);
+  insert(0xB);
+  insert(0xC);
+  insert(0xD);
+  EXPECT_TRUE(cache_->take_evicted().empty());
+
+  cache_->lookup(0xA);
+  cache_->lookup(0xC);
+  EXPECT_EQ(insert(0xE), mem);
+
+  std::vector<HostRange> evicted = cache_->take_evicted();
+  ASSERT_EQ(evicted.size(), 3);
+  expect_range(evicted[0], mem + kBlockSize, kBlockSize);     // 0xB
+  expect_range(evicted[1], mem + 3 * kBlockSize, kBlockSize); // 0xD
+  expect_range(evicted[2], mem, 4 * kBlockSize);
+
+  const uint8_t *old = mem + 4 * kBlockSize;
+  EXPECT_EQ(cache_->lookup(0xA), old);
+  EXPECT_EQ(cache_->lookup(0xC), old + kBlockSize);
+  EXPECT_EQ(cache_->lookup(0xB), nullptr);
+  EXPECT_EQ(cache_->lookup(0xD), nullptr);
+  EXPECT_EQ(cache_->size(), 3);
+}
+
+TEST_F(CodeCacheLayoutTest, OldRingEvictsOldestBlocksOnWrap) {
+  const uint8_t *mem = nullptr;
+  const uint8_t *old = nullptr;
+  // every round fills the nursery; the next round's first insert
+  // promotes all of it
+  for (uint64_t round = 0; round < 4; ++round) {
+    for (uint64_t i = 0; i < 4; ++i) {
+      uint64_t guest_addr = round * 4 + i;
+      const uint8_t *host = insert(guest_addr);
+      if (round == 0 && i == 0) {
+        mem = host;
+        old = mem + 4 * kBlockSize;
+      }
+      cache_->lookup(guest_addr);
+    }
+    std::vector<HostRange> evicted = cache_->take_evicted();
+    if (round == 0) {
+      EXPECT_TRUE(evicted.empty());
+      continue;
+    }
+    // only the nursery itself: the previous round all got promoted
+    ASSERT_EQ(evicted.size(), 1);
+    expect_range(evicted[0], mem, 4 * kBlockSize);
+  }
+  // 12 promoted blocks fill the old ring exactly
+  EXPECT_EQ(cache_->lookup(0), old);
+  EXPECT_EQ(cache_->lookup(11), old + 11 * kBlockSize);
+
+  // promoting round 3 wraps around over round 0
+  insert(16);
+  std::vector<HostRange> evicted = cache_->take_evicted();
+  ASSERT_EQ(evicted.size(), 5);
+  for (size_t i = 0; i < 4; ++i) {
+    expect_range(evicted[i], old + i * kBlockSize, kBlockSize);
+  }
+  expect_range(evicted[4], mem, 4 * kBlockSize);
+
+  for (uint64_t guest_addr = 0; guest_addr < 4; ++guest_addr) {
+    EXPECT_EQ(cache_->lookup(guest_addr), nullptr);
+  }
+  for (uint64_t i = 0; i < 4; ++i) {
+    EXPECT_EQ(cache_->lookup(12 + i), old + i * kBlockSize);
+  }
+  EXPECT_EQ(cache_->lookup(4), old + 4 * kBlockSize);
+  EXPECT_EQ(cache_->lookup(16), mem);
+}
+
+} // namespace
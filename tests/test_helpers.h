@@ -0,0 +1,62 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "qream/backend.h"
+#include "qream/code_cache.h"
+#include "qream/ir.h"
+#include "qream/memory.h"
+#include "qream/runtime.h"
+
+inline Register reg(uint8_t enc) { return Register{enc, 3}; }
+
+inline Operation op(uint64_t addr, IROp irop,
+                    std::array<Access, 3> operands, size_t num_operands) {
+  return Operation{addr, irop, VectorShape::Scalar, ScalarDType::Int64,
+                   operands, num_operands};
+}
+
+// Runs blocks for the host backend through a dispatcher, once `start`
+// has created one.
+class DispatcherTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    trampoline_ = emit_trampoline(backend_);
+    absl::StatusOr<void *> entry = map_executable(trampoline_);
+    ASSERT_TRUE(entry.ok()) << entry.status();
+    entry_ = *entry;
+  }
+
+  void TearDown() override {
+    dispatcher_.reset();
+    unmap_executable(entry_, trampoline_.size());
+  }
+
+  // `enter` stands in for the trampoline, e.g. to wrap it.
+  void start(CodeCacheOptions options = {}, EntryFn enter = nullptr) {
+    absl::StatusOr<CodeCache> cache = CodeCache::create(backend_, options);
+    ASSERT_TRUE(cache.ok()) << cache.status();
+    dispatcher_.emplace(enter ? enter : trampoline(), std::move(*cache));
+  }
+
+  EntryFn trampoline() const { return reinterpret_cast<EntryFn>(entry_); }
+
+  void add_block(uint64_t guest_addr, const std::vector<Operation> &ops,
+                 MemoryMode mem_mode = MemoryMode::Segmented) {
+    absl::StatusOr<std::vector<uint8_t>> code =
+        transpile(backend_, ops, mem_mode);
+    ASSERT_TRUE(code.ok()) << code.status();
+    absl::Status added = dispatcher_->add_block(guest_addr, *code);
+    ASSERT_TRUE(added.ok()) << added;
+  }
+
+  Backend backend_ = host_backend();
+  std::vector<uint8_t> trampoline_;
+  void *entry_ = nullptr;
+  std::optional<Dispatcher> dispatcher_;
+};
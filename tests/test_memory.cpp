@@ -0,0 +1,61 @@
+#include <cstdint>
+#include <cstring>
+
+#include <gtest/gtest.h>
+
+#include "qream/memory.h"
+
+namespace {
+
+TEST(GuestMemory, FlatSegmentsLiveInTheWindow) {
+  absl::StatusOr<GuestMemory> memory = GuestMemory::flat();
+  ASSERT_TRUE(memory.ok()) << memory.status();
+
+  absl::StatusOr<AllocatedSegment> seg =
+      memory->mapInto(0x10000, 100, SegmentFlags{});
+  ASSERT_TRUE(seg.ok()) << seg.status();
+  EXPECT_EQ(seg->mem, memory->window_base + 0x10000);
+  EXPECT_EQ(seg->length, 4096);
+  std::memset(seg->mem, 0xAB, seg->length);
+
+  // the last page of the window is fine too
+  EXPECT_TRUE(
+      memory->mapInto(kFlatWindowSize - 4096, 4096, SegmentFlags{}).ok());
+}
+
+TEST(GuestMemory, FlatRejectsBadRanges) {
+  absl::StatusOr<GuestMemory> memory = GuestMemory::flat();
+  ASSERT_TRUE(memory.ok()) << memory.status();
+  ASSERT_TRUE(memory->mapInto(0x10000, 0x2000, SegmentFlags{}).ok());
+
+  EXPECT_EQ(memory->mapInto(0x20010, 4096, SegmentFlags{}).status().code(),
+            absl::StatusCode::kInvalidArgument);
+  EXPECT_EQ(memory->mapInto(0x30000, 0, SegmentFlags{}).status().code(),
+            absl::StatusCode::kInvalidArgument);
+  EXPECT_EQ(memory->mapInto(kFlatWindowSize - 4096, 8192, SegmentFlags{})
+                .status()
+                .code(),
+            absl::StatusCode::kOutOfRange);
+  EXPECT_EQ(memory->mapInto(kFlatWindowSize, 4096, SegmentFlags{})
+                .status()
+                .code(),
+            absl::StatusCode::kOutOfRange);
+  EXPECT_EQ(memory->mapInto(~uint64_t{0} & ~uint64_t{0xFFF}, 8192,
+                            SegmentFlags{})
+                .status()
+                .code(),
+            absl::StatusCode::kInvalidArgument);
+  EXPECT_EQ(memory->mapInto(0x11000, 4096, SegmentFlags{}).status().code(),
+            absl::StatusCode::kAlreadyExists);
+  EXPECT_EQ(memory->segments.size(), 1);
+}
+
+TEST(GuestMemory, SegmentedRejectsOverlap) {
+  GuestMemory memory;
+  ASSERT_TRUE(memory.mapInto(0x1000, 0x1000, SegmentFlags{}).ok());
+  EXPECT_EQ(memory.mapInto(0x0800, 0x1000, SegmentFlags{}).status().code(),
+            absl::StatusCode::kAlreadyExists);
+  EXPECT_TRUE(memory.mapInto(0x2000, 0x1000, SegmentFlags{}).ok());
+}
+
+} // namespace